@@ -1,7 +1,7 @@
 #include <avr/sleep.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
-#include <util/crc16.h>
+#include <avr/pgmspace.h>
 
 #include <md5.h>
 #include <zzjduino.h>
@@ -11,24 +11,150 @@
 #define SDCARD_CPP
 #include "SDCard.h"
 
-#define SERIAL_DEBUG 1
+// prints the free RAM at startup, which pulls in Serial and its buffers
+//#define SERIAL_DEBUG 1
 
 // global variables for instruction handling
 uint16_t dlen;
 uint8_t inst;
-uint8_t buffer[BUFFER_SIZE];
+uint8_t argBuffer[ARG_BUFFER_SIZE];
+uint8_t * buffer = argBuffer;	// arguments of the running instruction, see aux_args
+uint8_t lastError;	// error code of the last SET_ERROR
+
+// counters for STATS
+stats_t stats;
+#if STATS_SLOTS
+inst_stats_t instStats[STATS_SLOTS];
+#endif
+uint16_t fifoOut = 0;	// bytes written to the fifo, not yet added to stats
+
+// trace ring, oldest entry is traceCount entries behind traceHead
+trace_t traceRing[TRACE_SIZE];
+uint8_t traceHead = 0;
+uint8_t traceCount = 0;
 
 // state variables
 bool canUseSD = false;
 uint8_t currDir = 0;
+uint8_t options = OPT_READ_AHEAD;
+uint8_t openMode;		// of the selected handle, the others keep theirs in handles[]
+int8_t fileContig;		// open file is contiguous: -1 not checked yet, 0 no, 1 yes
+uint32_t fileFirstBlock;
+uint32_t chainIndex;		// cluster index and number file_block last walked to,
+uint32_t chainCluster = 0;	// when the open file is not contiguous. 0 to restart
+
+// second buffer, used for read-ahead, write-behind and large arguments
+uint8_t auxBuffer[BUFFER_SIZE];
+uint8_t auxMode = AUX_IDLE;
+uint16_t auxLen;	// valid bytes in auxBuffer
+uint16_t auxPos;	// next byte to hand out
+
+uint32_t raHits = 0;
+uint32_t raMisses = 0;
+
+// the next block of the open file, read for a READ into sdFat's cache block
+// because the aux buffer still held the start of it. see file_fetch
+byte * fetchBlock = 0;
+uint16_t fetchPos;	// next byte of fetchBlock to hand out
+uint16_t fetchLeft;	// bytes file_fetch made ready, not yet taken
+
+bool wbFailed = false; // staged write could not be committed
+bool sectorFailed = false; // a WRITE_SECTOR block failed to program
+
+// multi-block transfer left open on the card between commands
+uint8_t cardMode = CARD_IDLE;
+bool cardSectors;	// the open write holds WRITE_SECTOR data, not the open file's
+uint32_t cardNext;		// block the open transfer continues at
+uint16_t cardUsed;		// millis() when it last moved, for the idle timeout
+bool fileBehind = false;	// blocks of the open file went through the engine,
+uint32_t filePos;			// so sdFat's position lags this one until card_stop
+
+// incremental MD5_STEP hash
+md5_state_t hashState;
+SdFile hashFile;
+uint8_t hashSource = HASH_NONE;
+uint8_t hashHandle;	// handle hashed by HASH_OPEN
+uint32_t hashPos;	// next offset to hash
+uint32_t hashLeft;	// bytes still to hash
+uint32_t hashDone;	// bytes hashed so far
+
+// directory listing position, so DIR pages do not rescan from the start
+uint32_t dirCursor;
+uint8_t dirPage;
+bool dirCursorValid = false;
+
+// name index of the working directory, built on first use. the name_hash
+// of each entry by its position in the directory, 0 where there is no file
+#if DIR_INDEX_SIZE
+uint8_t dirIndex[DIR_INDEX_SIZE];
+#endif
+uint8_t dirIndexState = DIR_INDEX_INVALID;
+
+// CRC16 (poly 0xA001, as _crc16_update) of every byte value
+const uint16_t crc16Table[256] PROGMEM = {
+	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+	0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+	0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+	0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+	0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+	0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+	0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+	0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+	0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+	0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+	0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+	0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+	0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+	0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+	0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+	0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+// raw sector access
+uint32_t sector;		// next sector
+uint32_t sectorCount = 0;
+bool sectorRelative;	// sector is within the mounted image
+uint32_t cardBlocks = 0;	// card size, read once - CMD9 would break an open transfer
+
+// mounted image
+extent_t imageMap[MAX_IMAGE_EXTENTS];
+uint8_t imageExtents = 0;
+uint8_t imageLast;		// extent used by the last lookup
+uint32_t imageSectors = 0;
 
 SdFat sdFat;
 
-SdFile openFile;	// working file
+// file handles, see SELECT. the selected one is the working file
+handle_t handles[MAX_HANDLES];
+uint8_t handleSel = 0;
+SdFile * openFile = &handles[0].file;
+
+// written through sdFat but not yet synced, see SYNC_IDLE_MS
+bool fileDirty = false;
+uint16_t dirtyTime;
 
-// used for wake-up on status write - EMPTY_INTERRUPT generates reti and nothing else
-// SIGNAL(INT0_vect) would generate a prologue and epilogue
-EMPTY_INTERRUPT(INT0_vect);
+volatile uint32_t cmdTime; // micros() when Q last went high
+
+// Q went high - wakes us from sleep and notes when the command arrived
+ISR(INT0_vect) {
+	cmdTime = micros();
+}
 
 // soft reset
 SIGNAL(INT1_vect) {
@@ -36,27 +162,8 @@ SIGNAL(INT1_vect) {
 }
 
 int main(void) {
-	MCUSR = 0; // required for wdt_disable to actually work
-	wdt_disable();
-	
-	// set up output port
-	PORTC = bits(REG_CS, LED, IOW, IOR, FF_RESET, FIFO_RESET);
-	DDRC = bits(REG_CS, ERR_BIT, LED, IOW, IOR, FF_RESET, FIFO_RESET);
-	
-	// turn on SPI
-	SPCR = bits(SPE0, MSTR0);
-	
-	// set up interrupt 0 & 1
-	// int1 on rising edge (ISCn1 = 1, ISCn0 = 1)
-	// int0 on falling edge (ISCn1 = 1, ISCn0 = 0);
-	EICRA |= bits(ISC11, ISC01, ISC00); 
-	EIMSK |= bits(INT1); // enable interrupt 1 (soft reset)
-	
-	// start millis timer
-	millis_start();
-	
-	sei(); // interrupts on
-	set_sleep_mode(SLEEP_MODE_STANDBY);
+	stack_paint(); // before interrupts are on
+	hal_init();
 	
 #ifdef SERIAL_DEBUG
 	Serial.begin(38400);
@@ -66,76 +173,55 @@ int main(void) {
 	
 	canUseSD = sdFat.begin(-1 /*chip select - not used*/, SPI_FULL_SPEED);
 	
+	if (canUseSD)
+		cardBlocks = sdFat.card()->cardSize();
+	
     //root.openRoot(&volume); // open root directory
 	
 	if (!canUseSD)
-		bset(PORTC, ERR_BIT);
-	
-	volatile uint32_t t; // weird behavior without volatile...
+		err_set();
 	
 	delay(10);
 	
-	bclr(PORTC, LED);
+	led_off();
 	disable_ctrl();
 	fifo_reset();
 	
+	ff_reset();
+	
 	while(true) {
-		ff_reset();
-		t = 0;
-		while (!bisset(PIND, Q))  // wait until the flip-flop is set
-			if (++t >= 1700000) { // around 2.5 seconds
-				
-				// millis will not wake us as only timer2 can wake from sleep
-				bset(EIMSK, INT0);// enable wake interrupt
-				do_sleep();		  // sleep until interrupt
-				bclr(EIMSK, INT0);// disable wake interrupt
-			
-				t = 0;			  // one more loop, to make sure ff is set
-			}
+		wait_for_command(true);
 		
-		Serial.println("Go time");
 		// OK, flip-flop is set, time to do stuff
-		bclr(PORTC, ERR_BIT);
-		bset(PORTC, LED);
+		uint16_t start = millis();
+		
+		// Q stays high until ff_reset, so INT0 cannot touch cmdTime here
+		uint32_t late = micros() - cmdTime;
+		
+		if (late > stats.latencyMaxUs)
+			stats.latencyMaxUs = late;
+		
+		err_clear();
+		led_on();
 		
 		enable_ctrl();
 		data_in();
 		
 		// read the instruction byte from the register
-		// could move the clr to be the first thing and remove nops
-		// but this is better for the sake of readability
-		bclr(PORTC, REG_CS);
-		_NOP;
-		_NOP;
-		inst = PINA;
-		bset(PORTC, REG_CS);
+		inst = ctrl_read();
 		
-#ifdef SERIAL_DEBUG
-		Serial.print("Command: ");
-		Serial.println(inst);
-#endif
+		// if fifo is not empty, read its contents out. arguments that can be 
+		// larger than argBuffer go to the aux buffer, once what it held is settled
+		if (aux_args(inst)) {
+			aux_settle();
+			buffer = auxBuffer;
+			dlen = fifo_ingest(buffer);
+		} else {
+			buffer = argBuffer;
+			dlen = fifo_ingest_max(buffer, ARG_BUFFER_SIZE);
+		}
 		
-		// if fifo is not empty, read its contents out
-		if (bisset(PIND, EMPTY)) {
-			dlen = -1;
-			
-			// read in the entire fifo contents
-			while (bisset(PIND, EMPTY)) { // ~empty INACTIVE
-				bclr(PORTC, IOR);		
-				dlen++;				// do something productive while waiting for AVR sync circuit
-				_NOP;
-				buffer[dlen] = PINA;// read byte in
-				bset(PORTC, IOR);
-			}
-			
-			dlen ++; // dlen is now the count of data bytes
-		} else 
-			dlen = 0;
-			
-#ifdef SERIAL_DEBUG
-		Serial.print("Data bytes: ");
-		Serial.println(dlen);
-#endif
+		uint16_t len = dlen;
 		
 		data_tri();
 		fifo_reset(); // superfluous, really...
@@ -143,16 +229,43 @@ int main(void) {
 		
 		// handle the instruction
 		handle();
+		
+#if TRACE_LEVEL >= TRACE_ALL
+		trace(TRACE_COMMAND, len, start);
+#elif TRACE_LEVEL >= TRACE_ERRORS
+		if (err_is_set())
+			trace(TRACE_COMMAND, len, start);
+#endif
+		
+		stats_record(len, start);
 
 		// clean up, tristate everything shared
 		data_tri();
 		disable_ctrl();	
-		bclr(PORTC, LED);
+		led_off();
+		
+		ff_reset();
 	}
 	
 	return 0;
 }
 
+// instructions whose argument can be larger than ARG_BUFFER_SIZE
+inline bool aux_args(uint8_t i) {
+	switch (i) {
+		case WRITE:
+		case WRITE_AT:
+		case WRITE_SECTOR:
+		case WRITE_STREAM:
+		case BATCH:
+		case ECHO:
+		case CRCTEST:
+			return true;
+	}
+	
+	return false;
+}
+
 inline bool containsFilename(void* b, uint16_t dlen) {
 	byte * inb  = (byte*)b;
 	for (uint8_t i = 0; i < 13 && i < dlen; i++)
@@ -172,14 +285,109 @@ FUNC_HANDLER(OPEN) {
 	if (!containsFilename(filename,dlen)) 
 		SET_ERROR(BAD_ARGUMENT);
 	
-	if (!openFile.open(filename, buffer[0]))
+	uint8_t mode = buffer[0];
+	uint16_t index;
+	bool opened;
+	uint8_t found = NAME_UNKNOWN;
+	
+	// a create would only throw away an index built for it
+	if (!(mode & O_CREAT) || dirIndexState != DIR_INDEX_INVALID)
+		found = dir_lookup(filename, &index);
+	
+	switch (found) {
+		case NAME_FOUND: // open the entry directly
+			opened = openFile->open(sdFat.vwd(), index, mode);
+			break;
+		case NAME_ABSENT:
+			if (!(mode & O_CREAT)) {
+				opened = false;
+				break;
+			}
+			// fall through, file will be created
+		default:
+			opened = openFile->open(filename, mode);
+			
+			if (mode & O_CREAT) // may have added an entry
+				dirIndexState = DIR_INDEX_INVALID;
+	}
+	
+	if (!opened)
+		SET_ERROR(FAILED_TO_OPEN);
+	
+	openMode = mode;
+	fileContig = -1;
+	chainCluster = 0;
+}
+
+FUNC_HANDLER(CREATE_CONTIGUOUS) {
+	if (fileOpen)
+		SET_ERROR(FILE_ALREADY_OPEN);
+	
+	char* filename = (char*)buffer + 4;
+	
+	if (dlen < 5 || !containsFilename(filename, dlen - 4)) 
+		SET_ERROR(BAD_ARGUMENT);
+	
+	dirIndexState = DIR_INDEX_INVALID;
+	
+	if (!openFile->createContiguous(sdFat.vwd(), filename, readuint32(buffer, 0)))
 		SET_ERROR(FAILED_TO_OPEN);
+	
+	openMode = O_RDWR;
+	fileContig = -1;
+	chainCluster = 0;
+}
+
+FUNC_HANDLER(SELECT) {
+	if (!dlen || buffer[0] >= MAX_HANDLES)
+		SET_ERROR(BAD_ARGUMENT);
+	
+	uint8_t prev = handleSel;
+	
+	handle_select(buffer[0]);
+	
+	if (wbFailed) { // staged data of the old handle is lost
+		wbFailed = false;
+		SET_ERROR(WRITE_ERROR);
+	}
+	
+	fifo_write(prev);
 }
 
 FUNC_HANDLER(CLOSE) {
+	aux_settle();
+	
+	if (fileOpen) {
+		if (!openFile->sync())
+			wbFailed = true;
+		
+		if (!openFile->close()) // closed regardless, the error is still reported
+			wbFailed = true;
+	}
+	
+	fileDirty = false;
+	
+	if (wbFailed) {
+		wbFailed = false;
+		SET_ERROR(WRITE_ERROR);
+	}
+}
+
+FUNC_HANDLER(FLUSH) {
+	aux_settle();
+	card_stop(); // raw sector writes may have no file to flush
+	
 	if (fileOpen) {
-		openFile.sync();
-		openFile.close();
+		if (!openFile->sync())
+			wbFailed = true;
+		
+		fileDirty = false;
+	}
+	
+	if (wbFailed || sectorFailed) {
+		wbFailed = false;
+		sectorFailed = false;
+		SET_ERROR(WRITE_ERROR);
 	}
 }
  
@@ -187,51 +395,338 @@ FUNC_HANDLER(READ) {
 	if (!fileOpen) 
 		SET_ERROR(FILE_NOT_OPEN);
 	
-	uint16_t req = READ_MAX_SZ;
+	uint16_t max = (options & OPT_CRC) ? READ_CRC_MAX_SZ : READ_MAX_SZ;
+	uint16_t req = max;
 	
 	if (dlen >= 2) {
 		req = readuint16(buffer, 0);
-		if (req > READ_MAX_SZ)
-			req = READ_MAX_SZ;
+		if (req > max)
+			req = max;
 	}
 	
-	int16_t rd = openFile.read(buffer, req);
+	int16_t rd = file_fetch(req);
 	
-	if (rd < 0) {
-#ifdef SERIAL_DEBUG
-		Serial.print(F("READ ERROR: "));
-		Serial.println(sdFat.card()->errorCode());
-#endif
+	if (rd < 0)
 		SET_ERROR(READ_ERROR);
-	} else {
-		fifo_write16(rd);
-		fifo_writeptr(buffer, rd);
+	
+	fifo_write16(rd);
+	
+	uint16_t crc = 0;
+	byte * p;
+	int16_t n;
+	
+	while ((n = file_take(rd, &p)) > 0) {
+		if (options & OPT_CRC)
+			crc = fifo_writeptr_crc(p, n, crc);
+		else
+			fifo_writeptr(p, n);
+	}
+	
+	if (n < 0) // only in a BATCH, which is parsed from its end then
+		SET_ERROR(READ_ERROR);
+	
+	if (options & OPT_CRC)
+		fifo_write16(crc);
+}
+
+FUNC_HANDLER(READ_STREAM) {
+	if (!fileOpen) 
+		SET_ERROR(FILE_NOT_OPEN);
+	
+	if (dlen < 4)
+		SET_ERROR(BAD_ARGUMENT);
+	
+	uint32_t remaining = readuint32(buffer, 0);
+	uint32_t total = 0;
+	uint16_t room = BUFFER_SIZE;
+	uint8_t status = 0;
+	bool eof = false;
+	
+	if (auxMode == AUX_WRITE_BEHIND)
+		aux_settle();
+	
+	uint32_t pos = file_position();
+	uint32_t size = openFile->fileSize();
+	
+	// stop at end of file, the trailer reports the short count
+	if (pos >= size)
+		remaining = 0;
+	else if (remaining > size - pos)
+		remaining = size - pos;
+	
+	while (remaining) {
+		if (!room) { // fifo is full, let the host drain it
+			if (!stream_handoff())
+				return;
+			room = BUFFER_SIZE;
+		}
+		
+		// whole blocks go from the card straight to the fifo, once nothing 
+		// prefetched is left to send first
+		uint32_t block;
+		
+		if (!eof && !(pos & (BUFFER_SIZE - 1)) && remaining >= BUFFER_SIZE && auxMode != AUX_READ_AHEAD) {
+			if (room < BUFFER_SIZE) { // hand over early, so the block fits
+				if (!stream_handoff())
+					return;
+				room = BUFFER_SIZE;
+			}
+			
+			if (file_block(pos, &block) && fifo_write_block(block)) {
+				room -= BUFFER_SIZE;
+				remaining -= BUFFER_SIZE;
+				total += BUFFER_SIZE;
+				pos += BUFFER_SIZE;
+				
+				fileBehind = true;
+				filePos = pos;
+				continue;
+			}
+			
+			SD_ERROR(TRACE_READ_ERROR, total);
+			status = ERROR_READ_ERROR;
+			eof = true;
+		}
+		
+		// anything else goes through the aux buffer, up to the next block edge
+		uint16_t req = BUFFER_SIZE - (pos & (BUFFER_SIZE - 1));
+		int16_t rd = 0;
+		
+		if (req > room)
+			req = room;
+		
+		if (req > remaining)
+			req = remaining;
+		
+		if (!eof) {
+			rd = file_fetch(req);
+			
+			if (rd < 0) {
+				SD_ERROR(TRACE_READ_ERROR, total);
+				status = ERROR_READ_ERROR;
+				rd = 0;
+			}
+			
+			if (rd < req) // error, pad out the rest
+				eof = true;
+		}
+		
+		byte * p;
+		int16_t n;
+		
+		while ((n = file_take(rd, &p)) > 0) // cannot fail, never batched
+			fifo_writeptr(p, n);
+		
+		for (uint16_t i = rd; i < req; i++)
+			fifo_write(0);
+		
+		total += rd;
+		room -= req;
+		remaining -= req;
+		pos += req;
+	}
+	
+	if (room < 5 && !stream_handoff())
+		return;
+	
+	fifo_write(status);
+	fifo_write32(total);
+}
+
+FUNC_HANDLER(READ_PACKED) {
+	if (!fileOpen) 
+		SET_ERROR(FILE_NOT_OPEN);
+	
+	uint16_t req = 0xFFFF;
+	
+	if (dlen >= 2)
+		req = readuint16(buffer, 0);
+	
+	uint16_t space = BUFFER_SIZE - 3; // room for PACKED_END and the count
+	uint16_t total = 0;
+	
+	// read in chunks small enough that even incompressible data still fits.
+	// each piece file_take hands out can cost a header byte: there are two at
+	// most, or inside a BATCH one for every ARG_BUFFER_SIZE bytes
+	uint16_t perHeader = (auxMode == AUX_BATCH) ? ARG_BUFFER_SIZE + 1 : 128;
+	
+	while (req && space >= 8) {
+		uint16_t chunk = space - space / perHeader - 2;
+		
+		if (chunk > req)
+			chunk = req;
+		
+		int16_t rd = file_fetch(chunk);
+		
+		if (rd < 0) {
+			if (!total)
+				SET_ERROR(READ_ERROR);
+			
+			break; // report it on the next read
+		}
+		
+		byte * p;
+		int16_t n;
+		
+		while ((n = file_take(rd, &p)) > 0)
+			space -= pack_to_fifo(p, n);
+		
+		if (n < 0) // only in a BATCH, as for READ
+			SET_ERROR(READ_ERROR);
+		
+		total += rd;
+		req -= rd;
+		
+		if ((uint16_t)rd < chunk) // end of file
+			break;
 	}
+	
+	fifo_write(PACKED_END);
+	fifo_write16(total);
 }
 
 FUNC_HANDLER(WRITE) {
 	if(!fileOpen) 
 		SET_ERROR(FILE_NOT_OPEN);
 	
+	if (wbFailed) {
+		wbFailed = false;
+		SET_ERROR(WRITE_ERROR);
+	}
+	
+	if (options & OPT_CRC) {
+		if (dlen < 2)
+			SET_ERROR(BAD_ARGUMENT);
+		
+		dlen -= 2;
+		
+		if (crc16(buffer, dlen) != readuint16(buffer, dlen))
+			SET_ERROR(CRC_MISMATCH);
+	}
+	
 	if (!dlen)
 		return;
 	
-	uint16_t wr = openFile.write(buffer, dlen);
+	// the data landed at the start of the empty aux buffer, staging it is only
+	// a matter of keeping it there. inside a BATCH it is written at once
+	if ((options & OPT_WRITE_BEHIND) && auxMode == AUX_IDLE) {
+		auxMode = AUX_WRITE_BEHIND;
+		auxLen = dlen;
+		
+		fifo_write16(dlen);
+		return;
+	}
+	
+	uint16_t wr = file_write(buffer, dlen, 1);
 	
 	if (!wr)
 		SET_ERROR(WRITE_ERROR);
 	
 	fifo_write16(wr);
- 
-    /*uint16_t crc = 0;
-    
-    for (int i = 0; i < dlen; i++)
-        crc = _crc16_update(crc,buffer[i]);
-    
-    fifo_write16(crc);*/
 }
 
 
+FUNC_HANDLER(READ_AT) {
+	if (!fileOpen) 
+		SET_ERROR(FILE_NOT_OPEN);
+	
+	if (dlen < 4) 
+		SET_ERROR(BAD_ARGUMENT);
+	
+	if (!file_seek(readuint32(buffer, 0)))
+		SET_ERROR(OPERATION_FAILED);
+	
+	// leave the count where READ expects it
+	dlen -= 4;
+	buffer[0] = buffer[4];
+	buffer[1] = buffer[5];
+	
+	READ_handler();
+}
+
+FUNC_HANDLER(WRITE_AT) {
+	if (!fileOpen) 
+		SET_ERROR(FILE_NOT_OPEN);
+	
+	if (dlen < 4) 
+		SET_ERROR(BAD_ARGUMENT);
+	
+	dlen -= 4;
+	
+	if (!file_seek(readuint32(buffer, dlen)))
+		SET_ERROR(OPERATION_FAILED);
+	
+	WRITE_handler();
+}
+
+FUNC_HANDLER(WRITE_STREAM) {
+	if (!fileOpen) 
+		SET_ERROR(FILE_NOT_OPEN);
+	
+	if (dlen < 4)
+		SET_ERROR(BAD_ARGUMENT);
+	
+	if (wbFailed) {
+		wbFailed = false;
+		SET_ERROR(WRITE_ERROR);
+	}
+	
+	uint32_t remaining = readuint32(buffer, 0);
+	uint32_t total = 0;
+	uint16_t fill = 0;	// bytes gathered in auxBuffer towards a whole block
+	uint8_t status = 0;
+	
+	// data is received straight into the aux buffer until it holds a whole 
+	// block. data that followed the length moves to its start
+	uint16_t got = dlen - 4;
+	
+	memmove(auxBuffer, auxBuffer + 4, got);
+	
+	while (true) {
+		if (got > remaining) // anything past the declared length is dropped
+			got = remaining;
+		
+		remaining -= got;
+		fill += got;
+		
+		if (status) // after an error the rest is still taken from the host, but not written
+			fill = 0;
+		
+		if (fill == BUFFER_SIZE || (fill && !remaining)) {
+			if (file_write(auxBuffer, fill, 1 + (remaining >> 9)) == fill)
+				total += fill;
+			else
+				status = ERROR_WRITE_ERROR;
+			
+			fill = 0;
+		}
+		
+		if (!remaining)
+			break;
+		
+		// what did not fit the block is still in the fifo, take it before 
+		// asking the host for more
+		if (!fifo_has_data() && !stream_wait()) {
+			if (fill && !status) // keep what was received
+				file_write(auxBuffer, fill, 1);
+			
+			stream_end();
+			return;
+		}
+		
+		got = fill ? fifo_ingest_max(auxBuffer + fill, BUFFER_SIZE - fill) : fifo_ingest(auxBuffer);
+		stats.bytesIn += got;
+	}
+	
+	stream_end();
+	
+	if (status)
+		SD_ERROR(TRACE_WRITE_ERROR, total);
+	
+	fifo_write(status);
+	fifo_write32(total);
+}
+
 FUNC_HANDLER(SEEK) {
 	if (!fileOpen)
 		SET_ERROR(FILE_NOT_OPEN);
@@ -241,7 +736,7 @@ FUNC_HANDLER(SEEK) {
 	
 	uint32_t s = readuint32(buffer, 0);
 	
-	if(!openFile.seekSet(s))
+	if(!file_seek(s))
 		SET_ERROR(OPERATION_FAILED);
 }
 
@@ -254,97 +749,226 @@ FUNC_HANDLER(SEEKREL) {
 	
 	int32_t s = (int32_t)readuint32(buffer, 0);
 	
-	if(!openFile.seekSet(openFile.curPosition() + s))
+	if(!file_seek(file_position() + s))
 		SET_ERROR(OPERATION_FAILED);
 }
 
 FUNC_HANDLER(LENGTH) {
+	aux_settle();
+	
 	if (!fileOpen)
 		SET_ERROR(FILE_NOT_OPEN);
 	
-	fifo_write32(openFile.fileSize());
+	fifo_write32(openFile->fileSize());
 }
 
 FUNC_HANDLER(POSITION) { 
 	if (!fileOpen)
 		SET_ERROR(FILE_NOT_OPEN);
 	
-	fifo_write32(openFile.curPosition());
+	fifo_write32(file_position());
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-FUNC_HANDLER(FILE_MD5) {
-
-	SdFile md5File;
+// drop an unfinished MD5_STEP hash
+inline void hash_end() {
+	if (hashSource == HASH_FILE)
+		hashFile.close();
 	
+	hashSource = HASH_NONE;
+}
+
+FUNC_HANDLER(FILE_MD5) {
 	if (!containsFilename(buffer, dlen))
 		SET_ERROR(BAD_ARGUMENT);
 	
-	if(!md5File.open((char*)buffer, O_RDONLY)) 
+	aux_settle();
+	
+	SdFile file;
+	
+	if(!file.open((char*)buffer, O_RDONLY)) 
 		SET_ERROR(FAILED_TO_OPEN);
 
+	// works in the aux buffer, the state at its end and the data before it, 
+	// so an unfinished MD5_STEP hash is left alone
+	md5_state_t * state = (md5_state_t *)(auxBuffer + BUFFER_SIZE - sizeof(md5_state_t));
+	const uint16_t chunk = (BUFFER_SIZE - sizeof(md5_state_t)) & ~63; // whole MD5 blocks
 	int16_t rd = 0;
-    
-	md5_state_t state;
 	uint8_t digest[16];
 	
-	md5_init(&state);
+	md5_init(state);
 	
-	while ((rd = md5File.read(buffer, BUFFER_SIZE)) > 0)
-		md5_append(&state, buffer, rd);
+	while ((rd = file.read(auxBuffer, chunk)) > 0)
+		md5_append(state, auxBuffer, rd);
 	
 	if (rd < 0) {
-#ifdef SERIAL_DEBUG
-		Serial.print(F("READ ERROR: "));
-		Serial.println(sdFat.card()->errorCode());
-#endif
-		md5File.close();
+		file.close();
 		SET_ERROR(READ_ERROR);
 	}
 
-	md5_finish(&state, digest);
+	md5_finish(state, digest);
 	
-	fifo_write32(md5File.fileSize());
+	fifo_write32(file.fileSize());
 	fifo_writeptr(digest, 16);
 	
-	md5File.close();
+	file.close();
 }
 
-FUNC_HANDLER(CHDIR) {
-	if (!containsFilename(buffer, dlen)) 
+FUNC_HANDLER(MD5_STEP) {
+	if (!dlen) 
 		SET_ERROR(BAD_ARGUMENT);
 	
-	if (((buffer[0] == '/') || (buffer[0] == '\\')) && (buffer[1] == 0)) {
-		sdFat.chdir(true); // return to root
-	} else {
-		if (!sdFat.chdir((char*)buffer, true))
-			SET_ERROR(INVALID_DIR);
-	}
-}
-
-FUNC_HANDLER(DIR) {
-	dir_t p;
-	
-	int skip = 0;
-	int c = 0;
-	int8_t code;
-	
-	byte page = 0;
+	switch (buffer[0]) {
+		case MD5_BEGIN_FILE:
+			hash_end();
+			
+			if (!containsFilename(buffer + 1, dlen - 1))
+				SET_ERROR(BAD_ARGUMENT);
+			
+			if (!hashFile.open((char*)buffer + 1, O_RDONLY))
+				SET_ERROR(FAILED_TO_OPEN);
+			
+			hashPos = 0;
+			hashLeft = hashFile.fileSize();
+			hashSource = HASH_FILE;
+			break;
+		case MD5_BEGIN_OPEN: {
+				hash_end();
+				
+				if (!fileOpen)
+					SET_ERROR(FILE_NOT_OPEN);
+				
+				if (dlen < 9) 
+					SET_ERROR(BAD_ARGUMENT);
+				
+				aux_settle(); // staged writes are part of the file
+				
+				uint32_t size = openFile->fileSize();
+				
+				hashPos = readuint32(buffer, 1);
+				hashLeft = readuint32(buffer, 5);
+				
+				if (hashPos > size)
+					hashLeft = 0;
+				else if (hashLeft > size - hashPos)
+					hashLeft = size - hashPos;
+				
+				hashSource = HASH_OPEN;
+				hashHandle = handleSel;
+				break;
+			}
+		case MD5_CONTINUE: {
+				if (hashSource == HASH_NONE)
+					SET_ERROR(BAD_ARGUMENT);
+				
+				uint16_t blocks = (dlen >= 3) ? readuint16(buffer, 1) : 1;
+				SdFile * f = &hashFile;
+				uint32_t saved = 0;
+				bool ok = true;
+				
+				if (hashSource == HASH_OPEN) {
+					f = &handles[hashHandle].file;
+					
+					if (!f->isOpen())
+						SET_ERROR(FILE_NOT_OPEN);
+				}
+				
+				aux_settle(); // the data is read into the aux buffer
+				
+				if (hashSource == HASH_OPEN)
+					saved = f->curPosition();
+				
+				if (f->curPosition() != hashPos)
+					ok = f->seekSet(hashPos);
+				
+				for (; ok && hashLeft && blocks; blocks--) {
+					uint16_t req = (hashLeft < BUFFER_SIZE) ? hashLeft : BUFFER_SIZE;
+					int16_t rd = f->read(auxBuffer, req);
+					
+					if (rd <= 0) {
+						ok = false;
+						break;
+					}
+					
+					md5_append(&hashState, auxBuffer, rd);
+					
+					hashPos += rd;
+					hashLeft -= rd;
+					hashDone += rd;
+				}
+				
+				if (hashSource == HASH_OPEN) // leave the host's position alone
+					f->seekSet(saved);
+				
+				if (!ok)
+					SET_ERROR(READ_ERROR);
+				
+				fifo_write32(hashLeft);
+				return;
+			}
+		case MD5_FINISH: {
+				if (hashSource == HASH_NONE)
+					SET_ERROR(BAD_ARGUMENT);
+				
+				uint8_t digest[16];
+				
+				md5_finish(&hashState, digest);
+				hash_end();
+				
+				fifo_write32(hashDone);
+				fifo_writeptr(digest, 16);
+				return;
+			}
+		default:
+			SET_ERROR(BAD_ARGUMENT);
+	}
 	
-	if (dlen) {
-		page = buffer[0] + 1;
-		skip = page * 30;
+	md5_init(&hashState);
+	hashDone = 0;
+	
+	fifo_write32(hashLeft);
+}
+
+FUNC_HANDLER(CHDIR) {
+	if (!containsFilename(buffer, dlen)) 
+		SET_ERROR(BAD_ARGUMENT);
+	
+	dirCursorValid = false;
+	dirIndexState = DIR_INDEX_INVALID;
+	
+	if (((buffer[0] == '/') || (buffer[0] == '\\')) && (buffer[1] == 0)) {
+		sdFat.chdir(true); // return to root
+	} else {
+		if (!sdFat.chdir((char*)buffer, true))
+			SET_ERROR(INVALID_DIR);
 	}
+}
+
+FUNC_HANDLER(DIR) {
+	dir_t p;
+	
+	uint16_t skip = 0;
+	int c = 0;
+	
+	byte page = 0;
+	
+	if (dlen)
+		page = buffer[0] + 1;
 	
 	fifo_write(page);	
 	
-	sdFat.vwd()->rewind();	
+	SdBaseFile * vwd = sdFat.vwd();
 	
-	while (((code = sdFat.vwd()->readDir(&p)) > 0) && c < FILES_PER_DIR_PAGE) {
-		if (skip && skip--)
-			continue;
-		
+	// continuing from the last page, pick up where it stopped
+	if (page && dirCursorValid && page == (byte)(dirPage + 1)) {
+		vwd->seekSet(dirCursor);
+	} else {
+		vwd->rewind();
+		skip = page * FILES_PER_DIR_PAGE;
+	}
+	
+	while (c < FILES_PER_DIR_PAGE && vwd->readDir(&p) > 0) {
 		// done if past last used entry
 		if (p.name[0] == DIR_NAME_FREE) 
 			break;
@@ -357,6 +981,11 @@ FUNC_HANDLER(DIR) {
 		if (!DIR_IS_FILE_OR_SUBDIR(&p)) 
 			continue;
 		
+		if (skip) { // listed on an earlier page
+			skip--;
+			continue;
+		}
+		
 		fifo_writeptr(&p.name, 11);
 		
 		if (!DIR_IS_SUBDIR(&p)) {
@@ -367,74 +996,315 @@ FUNC_HANDLER(DIR) {
 		c++;
 	}
 	
+	dirCursor = vwd->curPosition();
+	dirPage = page;
+	dirCursorValid = true;
+	
 	if (c < FILES_PER_DIR_PAGE)
 		fifo_write(DIR_NO_MORE_FILES);
 }
 
-FUNC_HANDLER(BENCH_READ) {
+FUNC_HANDLER(BENCH) {
+	if (dlen < 10 || !containsFilename(buffer + 8, dlen - 8))
+		SET_ERROR(BAD_ARGUMENT);
+	
+	uint8_t mode = buffer[0];
+	bool random = (buffer[1] == BENCH_RANDOM);
+	uint16_t bs = readuint16(buffer, 2);
+	
+	if (!bs || bs > BUFFER_SIZE || mode > BENCH_MODE_MIXED)
+		SET_ERROR(BAD_ARGUMENT);
+	
+	uint32_t ops = readuint32(buffer, 4) / bs;
+	
 	SdFile benchFile;
 	
-	if (!benchFile.open("bench.txt", OPEN_READ))
-		SET_ERROR(FAILED_TO_OPEN);
+	if (mode != BENCH_MODE_READ) { // may create the file and allocate clusters
+		dirIndexState = DIR_INDEX_INVALID;
+		dirCursorValid = false;
+	}
 	
-	int16_t rd = 0;
-	uint32_t bytesTotal = 0;
+	if (!benchFile.open((char*)buffer + 8, (mode == BENCH_MODE_READ) ? OPEN_READ : OPEN_WRITE))
+		SET_ERROR(FAILED_TO_OPEN);
 	
-	while ((rd = benchFile.read(buffer, BUFFER_SIZE)) > 0)
-		bytesTotal += rd;
+	uint32_t slots = benchFile.fileSize() / bs;
 	
-	if (rd < 0) {
-#ifdef SERIAL_DEBUG
-		Serial.print(F("READ ERROR: "));
-		Serial.println(sdFat.card()->errorCode());
-#endif
+	if (random && !slots) {
 		benchFile.close();
+		SET_ERROR(BAD_ARGUMENT);
+	}
+	
+	// sequential whole blocks of a contiguous file run through the multi-block 
+	// engine, as READ_STREAM and writes to preallocated files do
+	uint32_t first, last;
+	bool direct = !random && bs == BUFFER_SIZE && mode != BENCH_MODE_MIXED
+		&& (mode == BENCH_MODE_READ || ops <= slots) && benchFile.contiguousRange(&first, &last);
+	
+	if (direct && ops > slots) // reads stop at the end of the file
+		ops = slots;
+	
+	aux_settle(); // the blocks go through the aux buffer
+	
+	for (uint16_t i = 0; i < bs; i++) 
+		auxBuffer[i] = i;
+	
+	uint32_t seed = 0x2545F491; // fixed, so runs are repeatable
+	uint32_t bytes = 0;
+	uint32_t fastest = 0xFFFFFFFF;
+	uint32_t slowest = 0;
+	uint32_t sum = 0;
+	uint32_t n;
+	uint32_t done = 0;
+	int16_t rw = 0;
+	bool write = false;
+	
+	uint32_t start = micros();
+	
+	for (n = 0; n < ops; n++) {
+		write = (mode == BENCH_MODE_WRITE) || (mode == BENCH_MODE_MIXED && (n & 1));
+		
+		if (random) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			benchFile.seekSet((seed % slots) * bs);
+		}
+		
+		uint32_t t = micros();
+		
+		if (direct)
+			rw = (write ? card_write(first + n, auxBuffer, ops - n) : card_read(first + n, auxBuffer)) ? bs : -1;
+		else
+			rw = write ? benchFile.write(auxBuffer, bs) : benchFile.read(auxBuffer, bs);
+		
+		t = micros() - t;
+		
+		if (rw <= 0)
+			break;
+		
+		bytes += rw;
+		sum += t;
+		done++;
+		
+		if (t < fastest)
+			fastest = t;
+		
+		if (t > slowest)
+			slowest = t;
+	}
+	
+	bool pending = wbFailed; // belongs to the open file, not to us
+	
+	if (direct && !card_stop()) { // last blocks failed to program
+		wbFailed = pending;
+		rw = -1;
+	}
+	
+	benchFile.close(); // writes are not done until synced
+	
+	uint32_t elapsed = micros() - start;
+	
+	if (write && rw <= 0)
+		SET_ERROR(WRITE_ERROR);
+	
+	if (rw < 0)
 		SET_ERROR(READ_ERROR);
+	
+	if (!done)
+		fastest = 0;
+	
+	fifo_write32(elapsed);
+	fifo_write32(bytes);
+	fifo_write32(fastest);
+	fifo_write32(done ? sum / done : 0);
+	fifo_write32(slowest);
+	fifo_write32(elapsed ? (uint64_t)bytes * 1000000 / elapsed : 0);
+}
+
+// the test pattern for FIFO_BENCH
+inline uint8_t fifo_bench_byte(uint16_t i) {
+	return i ^ (i >> 8);
+}
+
+FUNC_HANDLER(FIFO_BENCH) {
+	if (dlen)
+		SET_ERROR(BAD_ARGUMENT);
+	
+	aux_settle(); // the test bytes go through the aux buffer
+	
+	uint16_t cycles[4];
+	uint16_t got[2];
+	uint8_t bad = 0;
+	uint16_t out = fifoOut; // the test bytes never reach the host
+	uint16_t timer = cycles_begin();
+	
+	for (uint8_t pass = 0; pass < 2; pass++) {
+		for (uint16_t i = 0; i < BUFFER_SIZE; i++)
+			auxBuffer[i] = fifo_bench_byte(i);
+		
+		cli(); // nothing else may run inside the timed parts
+		
+		cycles_reset();
+		
+		if (!pass)
+			fifo_writeptr(auxBuffer, BUFFER_SIZE);
+		else
+			fifo_writeptr_bytewise(auxBuffer, BUFFER_SIZE);
+		
+		cycles[pass * 2] = cycles_read();
+		
+		data_in();
+		cycles_reset();
+		
+		got[pass] = pass ? fifo_ingest_bytewise(auxBuffer) : fifo_ingest(auxBuffer);
+		
+		cycles[pass * 2 + 1] = cycles_read();
+		
+		sei();
+		data_out();
+		
+		if (got[pass] != BUFFER_SIZE)
+			bad = 1;
+		
+		for (uint16_t i = 0; i < got[pass]; i++)
+			if (auxBuffer[i] != fifo_bench_byte(i))
+				bad = 1;
 	}
 	
-	fifo_write32(benchFile.fileSize());
+	cycles_end(timer);
+	fifo_reset();
+	fifoOut = out;
 	
-	benchFile.close();
+	fifo_writeptr(cycles, sizeof(cycles));
+	fifo_write(bad);
 }
 
-FUNC_HANDLER(BENCH_WRITE) {
-	SdFile benchFile;
+FUNC_HANDLER(MOUNT_IMAGE) {
+	imageExtents = 0;
+	imageSectors = 0;
+	
+	if (sectorRelative) // the old image can no longer be accessed
+		sectorCount = 0;
+	
+	if (!dlen) // unmount
+		return;
+	
+	if (!containsFilename(buffer, dlen)) 
+		SET_ERROR(BAD_ARGUMENT);
+	
+	SdFile image;
 	
-	if (!benchFile.open("bench.txt",OPEN_WRITE))
+	if (!image.open((char*)buffer, O_READ))
 		SET_ERROR(FAILED_TO_OPEN);
-		
-	uint32_t bytesTotal = 0;
-	size_t wr;
 	
-	for (int n = 0; n < 2000; n++) {
-		for (int i = 0; i < BUFFER_SIZE; i++) 
-			buffer[i] = i;
+	SdVolume * vol = sdFat.vol();
+	
+	uint8_t shift = vol->clusterSizeShift();
+	uint32_t sectors = image.fileSize() >> 9;
+	uint32_t cluster = image.firstCluster();
+	uint8_t n = 0;
+	
+	image.close();
+	
+	// walk the cluster chain once, merging adjacent clusters into extents
+	for (uint32_t s = 0; s < sectors; s += (1 << shift)) {
+		if (cluster < 2 || cluster > vol->clusterCount() + 1) 
+			SET_ERROR(READ_ERROR); // chain ends early or is corrupt
 		
-		wr = benchFile.write(buffer, BUFFER_SIZE);
+		uint32_t block = vol->dataStartBlock() + ((cluster - 2) << shift);
 		
-		if (!wr)
-			break;
+		if (!n || imageMap[n - 1].block + (s - imageMap[n - 1].sector) != block) {
+			if (n == MAX_IMAGE_EXTENTS)
+				SET_ERROR(IMAGE_FRAGMENTED);
+			
+			imageMap[n].sector = s;
+			imageMap[n].block = block;
+			n++;
+		}
 		
-		bytesTotal += wr;
+		if (!vol->dbgFat(cluster, &cluster))
+			SET_ERROR(READ_ERROR);
 	}
 	
-	if (!wr) {
-#ifdef SERIAL_DEBUG
-		Serial.println(F("WRITE ERROR"));
-#endif
-		benchFile.close();
+	imageExtents = n;
+	imageSectors = sectors;
+	imageLast = 0;
+	
+	fifo_write32(imageSectors);
+	fifo_write(imageExtents);
+}
+
+FUNC_HANDLER(SET_SECTOR) {
+	if (dlen < 4) 
+		SET_ERROR(BAD_ARGUMENT);
+	
+	sectorRelative = (dlen > 4 && (buffer[4] & SECTOR_RELATIVE));
+	
+	if (sectorRelative) {
+		if (!imageExtents)
+			SET_ERROR(NO_IMAGE);
+		
+		sectorCount = imageSectors;
+	} else 
+		sectorCount = cardBlocks;
+	
+	sector = readuint32(buffer, 0);
+	
+	if (sector >= sectorCount)
+		SET_ERROR(BAD_ARGUMENT);
+}
+
+FUNC_HANDLER(READ_SECTOR) {
+	if (dlen) { // select the sector first
+		SET_SECTOR_handler();
+		
+		if (err_is_set())
+			return;
+	}
+	
+	if (sector >= sectorCount)
+		SET_ERROR(BAD_ARGUMENT);
+	
+	aux_settle();
+	
+	if (!fifo_write_block(sector_block(sector)))
+		SET_ERROR(READ_ERROR);
+	
+	sector++;
+}
+
+FUNC_HANDLER(WRITE_SECTOR) {
+	if (dlen != BUFFER_SIZE) 
+		SET_ERROR(BAD_ARGUMENT);
+	
+	if (sector >= sectorCount)
+		SET_ERROR(BAD_ARGUMENT);
+	
+	if (sectorFailed) {
+		sectorFailed = false;
 		SET_ERROR(WRITE_ERROR);
 	}
 	
-	benchFile.close();
+	if (!card_write(sector_block(sector), buffer, 1))
+		SET_ERROR(WRITE_ERROR);
 	
-	fifo_write32(bytesTotal);
+	cardSectors = true;
+	sector++;
 }
 
 FUNC_HANDLER(EXISTS) {
 	if (!containsFilename(buffer, dlen)) 
 		SET_ERROR(BAD_ARGUMENT);
 	
+	uint16_t index;
+	
+	switch (dir_lookup((char*)buffer, &index)) {
+		case NAME_FOUND:
+			return;
+		case NAME_ABSENT:
+			SET_ERROR(NONEXISTANT_FILE);
+	}
+	
 	SdFile child;
 	
 	bool exists = child.open((char*) buffer, O_RDONLY);
@@ -449,8 +1319,26 @@ FUNC_HANDLER(DELETE) {
 	for (uint8_t i = 0; i < 13 && i < dlen; i++)
 		if (buffer[i] == 0 && i > 0) {
 			if (buffer[i+1] == 0xDE) {
-				if (!sdFat.remove((char*)buffer))
+				uint16_t index;
+				bool removed;
+				
+				switch (dir_lookup((char*)buffer, &index)) {
+					case NAME_FOUND: {
+							SdFile victim;
+							removed = victim.open(sdFat.vwd(), index, O_WRITE) && victim.remove();
+							break;
+						}
+					case NAME_ABSENT:
+						removed = false;
+						break;
+					default:
+						removed = sdFat.remove((char*)buffer);
+				}
+				
+				if (!removed)
 					SET_ERROR(OPERATION_FAILED);
+				
+				dirIndexState = DIR_INDEX_INVALID;
 				return;
 			}
 			break;
@@ -459,23 +1347,56 @@ FUNC_HANDLER(DELETE) {
 	SET_ERROR(BAD_ARGUMENT);
 }
 
+FUNC_HANDLER(BATCH) {
+	// check the whole batch before running any of it
+	for (uint16_t i = 0; i < dlen; i += 2 + buffer[i]) {
+		if (i + 2 > dlen || i + 2 + buffer[i] > dlen)
+			SET_ERROR(BAD_ARGUMENT);
+		
+		// these need the aux buffer, which holds the batch
+		if (buffer[i + 1] == BATCH || buffer[i + 1] == READ_STREAM || buffer[i + 1] == WRITE_STREAM
+			|| buffer[i + 1] == FILE_MD5 || buffer[i + 1] == MD5_STEP || buffer[i + 1] == BENCH
+			|| buffer[i + 1] == FIFO_BENCH)
+			SET_ERROR(BAD_ARGUMENT);
+	}
+	
+	// the batch arrived in the aux buffer, each sub-command finds its 
+	// arguments where they are
+	auxMode = AUX_BATCH;
+	
+	uint16_t total = dlen;
+	
+	for (uint16_t i = 0; i < total; ) {
+		dlen = auxBuffer[i];
+		inst = auxBuffer[i + 1];
+		buffer = auxBuffer + i + 2;
+		i += 2 + dlen;
+		
+		handle();
+		
+		if (err_is_set()) {
+			fifo_write(lastError);
+			break;
+		}
+		
+		fifo_write(0);
+	}
+	
+	inst = BATCH;
+	auxMode = AUX_IDLE;
+}
+
 //////////////////////////////////////////////////////////////
 
 inline void handle() {
-	if (bisset(PORTD, SW)) // card not present, disable all SD operations
+	if (!card_present()) // card not present, disable all SD operations
 		canUseSD = false;	
 	
 	switch (inst) {
-		case CRCTEST: {// crc16 of data
-				uint16_t chksm = 0;
-				
-				for (uint16_t i = 0; i < dlen; i++)
-					chksm = _crc16_update(chksm, buffer[i]);
-				
-				fifo_write16(dlen);
-				fifo_write16(chksm);
-				return;
-			}
+		case CRCTEST: // crc16 of data
+			fifo_write16(dlen);
+			fifo_write16(crc16(buffer, dlen));
+			return;
 		case HELLO: // simple hello response - returns 0xDEADBEEF 
 			fifo_write(0xDE);
 			fifo_write(0xAD);
@@ -486,6 +1407,53 @@ inline void handle() {
 			for (uint16_t i = 0; i < dlen; i++)
 				fifo_write(buffer[i]);
 
+			return;
+		case BATCH:
+			BATCH_handler();
+			return;
+		case FIFO_BENCH:
+			FIFO_BENCH_handler();
+			return;
+		case OPTIONS:
+			if (dlen)
+				options = buffer[0];
+			
+			fifo_write(options);
+			return;
+		case TRACE_DUMP:
+			fifo_write(traceCount);
+			
+			for (uint8_t i = traceCount; i; i--)
+				fifo_writeptr(&traceRing[(traceHead - i) & (TRACE_SIZE - 1)], sizeof(trace_t));
+			
+			if (dlen && buffer[0])
+				traceCount = 0;
+			
+			return;
+		case STATS:
+			fifo_write32(millis());
+			fifo_writeptr(&stats, sizeof(stats));
+			fifo_write16(stack_unused());
+			fifo_write(STATS_SLOTS);
+#if STATS_SLOTS
+			fifo_writeptr(instStats, sizeof(instStats));
+#endif
+			
+			if (dlen && buffer[0]) {
+				memset(&stats, 0, sizeof(stats));
+#if STATS_SLOTS
+				memset(instStats, 0, sizeof(instStats));
+#endif
+			}
+			
+			return;
+		case CACHE_STATS:
+			fifo_write32(raHits);
+			fifo_write32(raMisses);
+			
+			if (dlen && buffer[0])
+				raHits = raMisses = 0;
+			
 			return;
 	}
 	
@@ -493,30 +1461,771 @@ inline void handle() {
 	if (!canUseSD) // reset is required
 		SET_ERROR(SD_NOT_PRESENT);
 	
+	// these keep an open multi-block transfer going while access is sequential,
+	// everything else works through sdFat and needs the card back first
+	switch (inst) {
+		case READ:
+		case READ_AT:
+		case READ_STREAM:
+		case READ_PACKED:
+		case WRITE:
+		case WRITE_AT:
+		case WRITE_STREAM:
+		case SEEK:
+		case SEEKREL:
+		case POSITION:
+		case LENGTH:
+		case SET_SECTOR:
+		case READ_SECTOR:
+		case WRITE_SECTOR:
+			break;
+		default:
+			card_stop();
+	}
+	
 	switch (inst) {
 			CASE_HANDLER(EXISTS);
 			CASE_HANDLER(DIR);
 			CASE_HANDLER(CHDIR);
 			CASE_HANDLER(DELETE);
 			
+			CASE_HANDLER(MOUNT_IMAGE);
+			CASE_HANDLER(SET_SECTOR);
+			CASE_HANDLER(READ_SECTOR);
+			CASE_HANDLER(WRITE_SECTOR);
+			
 			CASE_HANDLER(FILE_MD5);
-			CASE_HANDLER(BENCH_READ);
-			CASE_HANDLER(BENCH_WRITE);
+			CASE_HANDLER(MD5_STEP);
+			CASE_HANDLER(BENCH);
 			
 			CASE_HANDLER(OPEN);
+			CASE_HANDLER(CREATE_CONTIGUOUS);
+			CASE_HANDLER(SELECT);
 			CASE_HANDLER(CLOSE);
+			CASE_HANDLER(FLUSH);
 			
 			CASE_HANDLER(LENGTH);
 			CASE_HANDLER(POSITION);
 			CASE_HANDLER(SEEK);
 			CASE_HANDLER(SEEKREL);
 			CASE_HANDLER(READ);
+			CASE_HANDLER(READ_STREAM);
+			CASE_HANDLER(READ_PACKED);
+			CASE_HANDLER(READ_AT);
+			CASE_HANDLER(WRITE_AT);
 			CASE_HANDLER(WRITE);
+			CASE_HANDLER(WRITE_STREAM);
 	}
 	
 	SET_ERROR(UNKNOWN_INSTRUCTION);
 }
 
+// card block holding the selected sector
+inline uint32_t sector_block(uint32_t s) {
+	if (!sectorRelative)
+		return s;
+	
+	// sequential access stays in the same extent, so start from the last one
+	uint8_t i = imageLast;
+	
+	if (imageMap[i].sector > s)
+		i = 0;
+	
+	while (i + 1 < imageExtents && imageMap[i + 1].sector <= s)
+		i++;
+	
+	imageLast = i;
+	
+	return imageMap[i].block + (s - imageMap[i].sector);
+}
+
+//////////////////////////////////////////////////////////////
+// working directory name index
+
+// find name in the working directory without scanning it
+// index receives the position of its directory entry if found
+inline uint8_t dir_lookup(const char * name, uint16_t * index) {
+#if DIR_INDEX_SIZE
+	uint8_t n83[11];
+	dir_t p;
+	
+	if (!make83(name, n83)) // not a plain 8.3 name, let sdFat deal with it
+		return NAME_UNKNOWN;
+	
+	if (dirIndexState == DIR_INDEX_INVALID)
+		dir_index_build();
+	
+	uint8_t hash = name_hash(n83);
+	SdBaseFile * vwd = sdFat.vwd();
+	
+	for (uint16_t i = 0; i < DIR_INDEX_SIZE; i++) {
+		if (dirIndex[i] != hash)
+			continue;
+		
+		// confirm against the entry itself
+		if (!vwd->seekSet(32UL * i) || vwd->readDir(&p) <= 0)
+			return NAME_UNKNOWN;
+		
+		if (!memcmp(p.name, n83, 11)) {
+			*index = i;
+			return NAME_FOUND;
+		}
+	}
+	
+	return (dirIndexState == DIR_INDEX_COMPLETE) ? NAME_ABSENT : NAME_UNKNOWN;
+#else
+	return NAME_UNKNOWN;
+#endif
+}
+
+// one pass over the working directory, recording where each name lives
+inline void dir_index_build() {
+#if DIR_INDEX_SIZE
+	dir_t p;
+	SdBaseFile * vwd = sdFat.vwd();
+	int8_t rd;
+	
+	memset(dirIndex, 0, sizeof(dirIndex));
+	dirIndexState = DIR_INDEX_COMPLETE;
+	
+	vwd->rewind();
+	
+	while ((rd = vwd->readDir(&p)) > 0) {
+		// done if past last used entry
+		if (p.name[0] == DIR_NAME_FREE) 
+			break;
+		
+		if (p.name[0] == DIR_NAME_DELETED || p.name[0] == '.') 
+			continue;
+		
+		if (!DIR_IS_FILE_OR_SUBDIR(&p)) 
+			continue;
+		
+		uint16_t i = (vwd->curPosition() >> 5) - 1;
+		
+		if (i >= DIR_INDEX_SIZE) {
+			dirIndexState = DIR_INDEX_PARTIAL;
+			return;
+		}
+		
+		dirIndex[i] = name_hash(p.name);
+	}
+	
+	if (rd < 0) // the rest could not be read
+		dirIndexState = DIR_INDEX_PARTIAL;
+#else
+	dirIndexState = DIR_INDEX_PARTIAL;
+#endif
+}
+
+// convert "name.ext" to the space padded 11 byte form used in directory entries
+// returns false if it is not a simple valid 8.3 name
+inline bool make83(const char * name, uint8_t * n83) {
+	uint8_t i = 0;
+	uint8_t end = 8;
+	char c;
+	
+	memset(n83, ' ', 11);
+	
+	while ((c = *name++)) {
+		if (c == '.') {
+			if (end == 11 || !i) // second dot or no base name
+				return false;
+			
+			end = 11;
+			i = 8;
+			continue;
+		}
+		
+		if (i == end || c <= ' ' || c >= 0x7F || strchr_P(PSTR("|<>^+=?/[];,*\"\\:"), c))
+			return false;
+		
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		
+		n83[i++] = c;
+	}
+	
+	return i != 0;
+}
+
+inline uint8_t name_hash(const uint8_t * n83) {
+	uint8_t h = 0;
+	
+	for (uint8_t i = 0; i < 11; i++)
+		h = ((h << 1) | (h >> 7)) ^ n83[i];
+	
+	return h ? h : 1; // 0 marks a position of the index without a file
+}
+
+//////////////////////////////////////////////////////////////
+// open file access & background work
+
+// PackBits encode count bytes into the fifo, returns the encoded size.
+// runs of 3 or more become 2 bytes, everything else goes out as literals
+inline uint16_t pack_to_fifo(const byte * p, uint16_t count) {
+	uint16_t out = 0;
+	uint16_t i = 0;
+	
+	while (i < count) {
+		uint8_t b = p[i];
+		uint8_t run = 1;
+		
+		while (i + run < count && run < 128 && p[i + run] == b)
+			run++;
+		
+		if (run >= 3) {
+			fifo_write(257 - run);
+			fifo_write(b);
+			out += 2;
+			i += run;
+			continue;
+		}
+		
+		// literals up to the start of the next run
+		uint16_t start = i;
+		
+		while (i < count && i - start < 128) {
+			if (i + 2 < count && p[i] == p[i + 1] && p[i] == p[i + 2])
+				break;
+			
+			i++;
+		}
+		
+		fifo_write(i - start - 1);
+		fifo_writeptr((void*)(p + start), i - start);
+		out += i - start + 1;
+	}
+	
+	return out;
+}
+
+// make the next count bytes of the open file ready to send, or as many as 
+// there are before the end of file. they come from the aux buffer: what was
+// prefetched, then whatever the engine reads next. nothing is sent, so a 
+// failed read can still be reported. the caller must take them all with
+// file_take before anything else uses sdFat. inside a BATCH, which holds the
+// aux buffer, file_take reads them itself and can still fail.
+// returns how many are ready, or -1 on a read error
+inline int16_t file_fetch(uint16_t count) {
+	if (auxMode == AUX_WRITE_BEHIND)
+		aux_settle();
+	
+	uint32_t pos = file_position();
+	uint32_t size = openFile->fileSize();
+	
+	if (pos >= size)
+		count = 0;
+	else if (count > size - pos)
+		count = size - pos;
+	
+	fetchLeft = count;
+	
+	if (auxMode == AUX_BATCH) {
+		card_stop();
+		return count;
+	}
+	
+	if (!count)
+		return 0;
+	
+	uint16_t have = (auxMode == AUX_READ_AHEAD) ? auxLen - auxPos : 0;
+	
+	if (have >= count) { // all of it was prefetched
+		raHits++;
+		return count;
+	}
+	
+	raMisses++;
+	
+	if (!have) {
+		if (aux_fill() <= 0) // nothing inside the file's size is an error too
+			return -1;
+		
+		have = auxLen;
+		
+		if (have >= count)
+			return count;
+	}
+	
+	// the aux buffer now ends at a block edge. the next block goes into sdFat's
+	// cache block until the start of it is sent, see file_take. the cache is 
+	// clean while a transfer is open, clearing it never talks to the card then
+	uint32_t at = file_card_pos();
+	uint32_t block;
+	
+	if (!(at & (BUFFER_SIZE - 1)) && at + BUFFER_SIZE <= size && file_block(at, &block)) {
+		fetchBlock = (byte *)sdFat.vol()->cacheClear();
+		
+		if (!fetchBlock || !card_read(block, fetchBlock)) {
+			fetchBlock = 0;
+			return -1;
+		}
+		
+		fileBehind = true;
+		filePos = at + BUFFER_SIZE;
+		fetchPos = 0;
+		return count;
+	}
+	
+	// the last part of the file, read through sdFat behind what is left
+	card_stop();
+	memmove(auxBuffer, auxBuffer + auxPos, have);
+	auxPos = 0;
+	auxLen = have;
+	
+	int16_t rd = openFile->read(auxBuffer + have, count - have);
+	
+	if (rd < 0)
+		return -1;
+	
+	auxLen += rd;
+	
+	if (auxLen < count) // the file was shorter than its size
+		fetchLeft = auxLen;
+	
+	return fetchLeft;
+}
+
+// hand out the next of the bytes file_fetch made ready, at most count. *p is
+// set to where they are. they can be in several pieces, so call until it 
+// returns 0. returns -1 if a read inside a BATCH failed
+inline int16_t file_take(uint16_t count, byte ** p) {
+	if (count > fetchLeft)
+		count = fetchLeft;
+	
+	if (!count)
+		return 0;
+	
+	if (auxMode == AUX_BATCH) { // argBuffer is free, the batch came in the aux buffer
+		if (count > ARG_BUFFER_SIZE)
+			count = ARG_BUFFER_SIZE;
+		
+		if (openFile->read(argBuffer, count) != (int16_t)count) {
+			fetchLeft = 0;
+			return -1;
+		}
+		
+		*p = argBuffer;
+	} else if (auxMode == AUX_READ_AHEAD) {
+		if (count > auxLen - auxPos)
+			count = auxLen - auxPos;
+		
+		*p = auxBuffer + auxPos;
+		auxPos += count;
+		
+		if (auxPos == auxLen)
+			auxMode = AUX_IDLE;
+	} else {
+		*p = fetchBlock + fetchPos;
+		fetchPos += count;
+	}
+	
+	fetchLeft -= count;
+	
+	// all sent, keep the rest of the block as prefetched data
+	if (!fetchLeft && fetchBlock) {
+		auxLen = BUFFER_SIZE - fetchPos;
+		auxPos = 0;
+		memcpy(auxBuffer, fetchBlock + fetchPos, auxLen);
+		
+		if (auxLen)
+			auxMode = AUX_READ_AHEAD;
+		
+		fetchBlock = 0;
+	}
+	
+	return count;
+}
+
+// write to the open file. whole aligned blocks inside the file go straight
+// to the card, sdFat never touches the FAT or directory for them. blocks is
+// how many the caller is about to write from here on, this one included
+inline uint16_t file_write(const byte * data, uint16_t count, uint32_t blocks) {
+	uint32_t pos = file_card_pos();
+	uint32_t size = openFile->fileSize();
+	uint32_t block;
+	
+	// read-only files never go to the card, appends are left for sdFat to place
+	if (count == BUFFER_SIZE && !(pos & (BUFFER_SIZE - 1)) && (openMode & (O_WRITE | O_APPEND)) == O_WRITE
+		&& pos + count <= size && file_block(pos, &block)) {
+		// the card pre-erases this many, a transfer ended short of them leaves the 
+		// rest undefined - so never reach past the file, or the cluster if fragmented
+		uint32_t end = (size - pos) >> 9;
+		
+		if (!fileContig) {
+			uint16_t perCluster = 1 << sdFat.vol()->clusterSizeShift();
+			uint16_t inCluster = perCluster - ((pos >> 9) & (perCluster - 1));
+			
+			if (inCluster < end)
+				end = inCluster;
+		}
+		
+		if (!card_write(block, data, blocks < end ? blocks : end))
+			return 0;
+		
+		fileBehind = true;
+		filePos = pos + count;
+		return count;
+	}
+	
+	card_stop();
+	
+	if (pos + count > size) // may allocate clusters
+		fileContig = -1;
+	
+	fileDirty = true;
+	dirtyTime = millis();
+	
+	return openFile->write(data, count);
+}
+
+// write sdFat's cached block and directory entry of the open file back
+inline void file_sync() {
+	card_stop();
+	
+	if (!openFile->sync())
+		wbFailed = true; // reported by the next write, FLUSH or CLOSE
+	
+	fileDirty = false;
+}
+
+// card block holding position pos of the open file
+// contiguous files are a sum, others are walked from the last position looked up
+inline bool file_block(uint32_t pos, uint32_t * block) {
+	if (fileContig < 0) {
+		uint32_t last;
+		card_end();
+		fileContig = openFile->contiguousRange(&fileFirstBlock, &last);
+	}
+	
+	if (fileContig) {
+		*block = fileFirstBlock + (pos >> 9);
+		return true;
+	}
+	
+	SdVolume * vol = sdFat.vol();
+	uint8_t shift = vol->clusterSizeShift();
+	uint32_t index = pos >> (9 + shift);
+	
+	if (!chainCluster || index < chainIndex) {
+		chainIndex = 0;
+		chainCluster = openFile->firstCluster();
+	}
+	
+	while (chainIndex < index) {
+		if (!fat_next(chainCluster, &chainCluster))
+			break;
+		
+		chainIndex++;
+	}
+	
+	if (chainIndex < index || chainCluster < 2 || chainCluster > vol->clusterCount() + 1) {
+		chainCluster = 0;
+		return false;
+	}
+	
+	*block = vol->dataStartBlock() + ((chainCluster - 2) << shift) + ((pos >> 9) & ((1 << shift) - 1));
+	return true;
+}
+
+// next cluster of a chain, read through sdFat's cache
+inline bool fat_next(uint32_t cluster, uint32_t * next) {
+	card_end();
+	return sdFat.vol()->dbgFat(cluster, next);
+}
+
+// make handle h the working file. pending data of the old one is settled 
+// first, as the aux buffer and the engine only follow the selected handle
+inline void handle_select(uint8_t h) {
+	if (h == handleSel)
+		return;
+	
+	aux_settle();
+	
+	if (fileDirty)
+		file_sync();
+	
+	card_stop();
+	
+	handle_t * p = &handles[handleSel];
+	
+	p->mode = openMode;
+	p->contig = fileContig;
+	p->firstBlock = fileFirstBlock;
+	p->chainIndex = chainIndex;
+	p->chainCluster = chainCluster;
+	
+	p = &handles[h];
+	handleSel = h;
+	
+	openFile = &p->file;
+	openMode = p->mode;
+	fileContig = p->contig;
+	fileFirstBlock = p->firstBlock;
+	chainIndex = p->chainIndex;
+	chainCluster = p->chainCluster;
+}
+
+// position of the open file on the card, sdFat's lags while the engine has it
+inline uint32_t file_card_pos() {
+	return fileBehind ? filePos : openFile->curPosition();
+}
+
+// position of the open file as the host sees it
+inline uint32_t file_position() {
+	if (auxMode == AUX_READ_AHEAD)
+		return file_card_pos() - (auxLen - auxPos);
+	
+	if (auxMode == AUX_WRITE_BEHIND)
+		return file_card_pos() + auxLen;
+	
+	return file_card_pos();
+}
+
+// move the open file to pos. nothing is done if it is already there, so 
+// prefetched or staged data survives
+inline bool file_seek(uint32_t pos) {
+	if (pos == file_position())
+		return true;
+	
+	if (auxMode == AUX_WRITE_BEHIND) // staged data may grow the file
+		aux_settle();
+	
+	if (pos > openFile->fileSize())
+		return false;
+	
+	if (auxMode == AUX_READ_AHEAD) // dropped, without rewinding sdFat over it
+		auxMode = AUX_IDLE;
+	
+	// only the engine moves. file_block finds the cluster through the chain 
+	// cursor, sdFat follows in card_stop if it needs the file
+	fileBehind = true;
+	filePos = pos;
+	return true;
+}
+
+// return the open file to the position the host expects
+// must be called before anything that depends on or changes the file position
+// if anything was pending, sdFat has the card again afterwards
+inline void aux_settle() {
+	if (auxMode == AUX_READ_AHEAD) { // rewind over data the host never read
+		uint32_t pos = file_position();
+		
+		card_stop();
+		openFile->seekSet(pos);
+	} else if (auxMode == AUX_WRITE_BEHIND) {
+		write_behind_flush();
+		card_stop();
+	} else // nothing pending, or BATCH, which holds no file data
+		return;
+	
+	auxMode = AUX_IDLE;
+}
+
+// commit staged WRITE data to the open file
+inline void write_behind_flush() {
+	if (auxMode != AUX_WRITE_BEHIND)
+		return;
+	
+	if (file_write(auxBuffer, auxLen, 1) != auxLen) {
+		TRACE(TRACE_WRITE_ERROR, auxLen); // counted when reported
+		wbFailed = true;
+	}
+	
+	auxMode = AUX_IDLE;
+}
+
+// prefetch the next part of the open file into the empty aux buffer
+// returns true if anything was read
+inline bool read_ahead() {
+	if (!fileOpen || openMode != OPEN_READ || auxMode != AUX_IDLE)
+		return false;
+	
+	return aux_fill() > 0; // a failed read is not retried until the host asks
+}
+
+// read the next part of the open file into the empty aux buffer: a whole 
+// block through the engine, or at an odd position up to the next block edge,
+// so that the following reads are whole blocks again.
+// returns the bytes read, or -1 on a read error
+inline int16_t aux_fill() {
+	uint32_t pos = file_card_pos();
+	uint32_t block;
+	int16_t rd;
+	
+	if (pos >= openFile->fileSize())
+		return 0;
+	
+	if (!(pos & (BUFFER_SIZE - 1)) && pos + BUFFER_SIZE <= openFile->fileSize() 
+		&& file_block(pos, &block)) {
+		// whole block, continue the card's read
+		if (!card_read(block, auxBuffer))
+			return -1;
+		
+		rd = BUFFER_SIZE;
+		fileBehind = true;
+		filePos = pos + BUFFER_SIZE;
+	} else {
+		card_stop();
+		
+		rd = openFile->read(auxBuffer, BUFFER_SIZE - (pos & (BUFFER_SIZE - 1)));
+		
+		if (rd < 0)
+			return -1;
+	}
+	
+	auxPos = 0;
+	auxLen = rd;
+	
+	if (rd)
+		auxMode = AUX_READ_AHEAD;
+	
+	return rd;
+}
+
+// background work between commands, most urgent first. each call does at 
+// most one block, so that is all a new command ever waits for. returns 
+// false when there is nothing to do
+inline bool run_job() {
+	if (!canUseSD)
+		return false;
+	
+	if (auxMode == AUX_WRITE_BEHIND) {
+		write_behind_flush();
+		return true;
+	}
+	
+	return (options & OPT_READ_AHEAD) && read_ahead();
+}
+
+// work that is due once the host has been quiet for a while
+// returns false when nothing was due
+inline bool run_timers() {
+	uint16_t now = millis();
+	
+	// do not leave the card mid-transfer
+	if (cardMode != CARD_IDLE && now - cardUsed >= CARD_IDLE_MS) {
+		card_stop();
+		return true;
+	}
+	
+	// do not leave the FAT and directory entry stale should power go
+	if (fileDirty && now - dirtyTime >= SYNC_IDLE_MS) {
+		file_sync();
+		return true;
+	}
+	
+	return false;
+}
+
+// true while run_timers has something that will come due
+inline bool timer_pending() {
+	return cardMode != CARD_IDLE || fileDirty;
+}
+
+//////////////////////////////////////////////////////////////
+// multi-block engine - a CMD18 read or CMD25 write stays open on the card
+// between commands for as long as access stays sequential. nothing else may
+// talk to the card while it is open: call card_stop() first.
+
+// continue the open transfer if it is at block, otherwise start a new one
+// count is the number of blocks a write is about to cover, for pre-erase. 
+// blocks pre-erased but not written when the transfer ends are left undefined,
+// so it must not reach past what the caller is sure to write
+inline bool card_begin(uint8_t mode, uint32_t block, uint32_t count) {
+	if (cardMode == mode && cardNext == block)
+		return true;
+	
+	card_end();
+	
+	// write back and forget whatever sdFat has cached, it may be one of these blocks
+	sdFat.vol()->cacheClear();
+	
+	Sd2Card * card = sdFat.card();
+	
+	if (!(mode == CARD_READ ? card->readStart(block) : card->writeStart(block, count)))
+		return false;
+	
+	cardMode = mode;
+	cardNext = block;
+	cardSectors = false;
+	return true;
+}
+
+// a block went through the open transfer
+inline void card_moved() {
+	cardNext++;
+	cardUsed = millis();
+}
+
+inline bool card_read(uint32_t block, byte * dst) {
+	if (card_begin(CARD_READ, block, 0) && sdFat.card()->readData(dst)) {
+		card_moved();
+		return true;
+	}
+	
+	card_abort();
+	return false;
+}
+
+inline bool card_write(uint32_t block, const byte * src, uint32_t count) {
+	if (card_begin(CARD_WRITE, block, count) && sdFat.card()->writeData(src)) {
+		card_moved();
+		return true;
+	}
+	
+	card_abort();
+	return false;
+}
+
+// end a transfer that failed, the caller reports the error
+inline void card_abort() {
+	if (cardMode == CARD_READ)
+		sdFat.card()->readStop();
+	else if (cardMode == CARD_WRITE)
+		sdFat.card()->writeStop();
+	
+	cardMode = CARD_IDLE;
+}
+
+// end the open transfer and give the card back to sdFat
+// blocks already acknowledged can still fail to program; that is reported 
+// like a failed write-behind, by the next WRITE, FLUSH or CLOSE, or for raw 
+// sectors by the next WRITE_SECTOR or FLUSH
+inline bool card_stop() {
+	bool ok = card_end();
+	
+	if (fileBehind) { // bring sdFat's idea of the open file up to date
+		fileBehind = false;
+		openFile->seekSet(filePos);
+	}
+	
+	return ok;
+}
+
+// end the open transfer, but leave sdFat's position of the open file behind.
+// enough for reading the FAT, or for starting another transfer
+inline bool card_end() {
+	bool ok = true;
+	
+	if (cardMode == CARD_READ)
+		sdFat.card()->readStop();
+	else if (cardMode == CARD_WRITE && !sdFat.card()->writeStop()) {
+		TRACE(TRACE_WRITE_ERROR, 0); // counted when reported
+		
+		if (cardSectors)
+			sectorFailed = true;
+		else
+			wbFailed = true;
+		
+		ok = false;
+	}
+	
+	cardMode = CARD_IDLE;
+	return ok;
+}
+
 inline uint16_t readuint16(byte * buffer, int pos) {
 	return *((uint16_t*)(buffer + pos));
 }
@@ -536,75 +2245,172 @@ inline void fifo_write16(uint16_t p) {
 }
 
 inline void fifo_write8(uint8_t b) {
-	PORTA = b;
-	bclr(PORTC,IOW);
-	bset(PORTC,IOW);
+	fifoOut++;
+	fifo_put(b);
 }
 
 inline void fifo_writeptr(void* p, uint16_t count) {
-	byte * ptr = (byte*)p;
-	for (uint16_t i = 0; i < count; i++)
-		fifo_write(ptr[i]);
+	fifoOut += count;
+	fifo_put_block((byte*)p, count);
 }
 
-inline void do_sleep() {
-	sleep_enable();
-	sei();
-	sleep_cpu();
-	sleep_disable();
+// fifo_writeptr that also returns the CRC16 of the bytes written, continuing
+// from crc
+inline uint16_t fifo_writeptr_crc(void* p, uint16_t count, uint16_t crc) {
+	fifoOut += count;
+	return fifo_put_crc((byte*)p, count, crc);
 }
 
-inline void do_reset() {
-	data_tri();
-	disable_ctrl();
-	wdt_enable(WDTO_15MS);
-	while(true) ;
+// table-driven CRC16, same result as _crc16_update over each byte
+inline uint16_t crc16(const byte * p, uint16_t count) {
+	uint16_t crc = 0;
+	
+	while (count--)
+		crc = (crc >> 8) ^ pgm_read_word(&crc16Table[(uint8_t)crc ^ *p++]);
+	
+	return crc;
 }
 
-inline void disable_ctrl() {
-	DDRC &= ~(bv(IOW) | bv(IOR));
-	bclr(PORTC, IOW); // set these after changing input direction so lines are not
-	bclr(PORTC, IOR); // set low at any point in time
+// account for an instruction that just completed
+inline void stats_record(uint16_t len, uint16_t start) {
+	stats.bytesIn += len;
+	stats.bytesOut += fifoOut;
+	fifoOut = 0;
+	
+	if (err_is_set()) {
+		stats.failed++;
+		
+		if (lastError == ERROR_READ_ERROR || lastError == ERROR_WRITE_ERROR)
+			stats.sdErrors++;
+	}
+	
+#if STATS_SLOTS
+	uint16_t ms = (uint16_t)millis() - start;
+	
+	// find the slot for this instruction, or claim a free one
+	for (uint8_t i = 0; i < STATS_SLOTS; i++) {
+		inst_stats_t * is = &instStats[i];
+		
+		if (is->calls && is->inst != inst)
+			continue;
+		
+		is->inst = inst;
+		
+		if (is->calls != 0xFFFF) // both stop rather than wrap
+			is->calls++;
+		
+		is->totalMs = (ms < 0xFFFF - is->totalMs) ? is->totalMs + ms : 0xFFFF;
+		
+		if (ms > is->maxMs)
+			is->maxMs = ms;
+		
+		return;
+	}
+#endif
 }
 
-inline void enable_ctrl() {
-	bset(PORTC, IOW); // set port first so that the lines are not pulled low 
-	bset(PORTC, IOR); // when output direction is changed
-	DDRC |= bv(IOW) | bv(IOR);
+// record an event for the current instruction, overwriting the oldest if full
+// costs a few microseconds, nothing waits on the UART
+inline void trace(uint8_t event, uint16_t arg, uint16_t start) {
+	trace_t * t = &traceRing[traceHead];
+	uint16_t ms = (uint16_t)millis() - start;
+	
+	t->event = event;
+	t->inst = inst;
+	t->arg = arg;
+	t->time = start;
+	t->ms = (ms > 255) ? 255 : ms;
+	t->err = err_is_set() ? lastError : 0;
+	t->sdErr = sdFat.card()->errorCode();
+	
+	traceHead = (traceHead + 1) & (TRACE_SIZE - 1);
+	
+	if (traceCount < TRACE_SIZE)
+		traceCount++;
 }
 
-inline void ff_reset() {
-	bclr(PORTC, FF_RESET);
-	bset(PORTC, FF_RESET);	
-}
+//////////////////////////////////////////////////////////////
+// bus protocol, on top of the hardware access functions
 
-inline void fifo_reset() {
-	bclr(PORTC, FIFO_RESET);
-	bset(PORTC, FIFO_RESET);
+// read one block and strobe it into the fifo without going through RAM
+// continues the card's open multi-block read when it is at this block
+inline bool fifo_write_block(uint32_t block) {
+	if (card_begin(CARD_READ, block, 0) && spi_block_to_fifo()) {
+		card_moved();
+		fifoOut += BUFFER_SIZE;
+		return true;
+	}
+	
+	card_abort();
+	return false;
 }
 
-inline byte fifo_read() {
-	byte tmp;
-	
-	bclr(PORTC, IOR);
-	_NOP; _NOP; // wait for valid data - AVR sync circuit (1.5 cycles)
-	tmp = PINA;
-	bset(PORTC, IOR);
+// hand a full fifo to the host and wait for it to ask for more
+// returns false if the host wrote anything other than the current instruction
+inline bool stream_handoff() {
+	bool more = stream_wait();
 	
-	return tmp;
+	stream_end();
+	return more;
 }
 
-inline void data_out() {
-	DDRA = 0xFF; // all input 
+// hand the fifo to the host, to drain or fill, and wait for the next strobe.
+// the bus is left reading the fifo, see stream_end
+// returns false if the host wrote anything other than the current instruction
+inline bool stream_wait() {
+	data_tri();
+	disable_ctrl();
+	ff_reset(); // busy low, host may now use the fifo
+	
+	stats.bytesOut += fifoOut;
+	fifoOut = 0;
+	
+	wait_for_command(false);
+	
+	enable_ctrl();
+	data_in();
+	
+	return ctrl_read() == inst;
 }
 
-inline void data_in() {
+// back to writing the fifo after stream_wait
+inline void stream_end() {
 	data_tri();
-	_NOP;  // syncronization
-	_NOP;
+	fifo_reset(); // discard anything the host left behind
+	data_out();
 }
 
-inline void data_tri() {
-	DDRA = 0;  // input mode
-	PORTA = 0; // all pull ups off
+// wait until the flip-flop is set, running background jobs (if allowed) and 
+// timers meanwhile. with nothing to do we sleep until INT0 - in idle mode 
+// while a timer is pending, so the millis tick wakes us to check it, and in 
+// standby otherwise, which only INT0 or INT1 end
+inline void wait_for_command(bool jobs) {
+	uint32_t start = millis(); // does not advance in standby
+	uint32_t busy = 0;
+	
+	while (!ff_is_set()) {
+		uint16_t t = millis();
+		
+		if ((jobs && run_job()) || run_timers()) {
+			busy += (uint16_t)millis() - t;
+			continue;
+		}
+		
+		bool timed = timer_pending();
+		
+		if (hal_sleep(timed) && !timed)
+			stats.sleeps++;
+	}
+	
+	stats.backgroundMs += busy;
+	stats.idleMs += millis() - start - busy;
 }
+
+//////////////////////////////////////////////////////////////
+// hardware access - nothing above touches a port, SPI or timer register
+
+#ifdef SDCARD_SIM
+#include "sim/SDCardHAL.h"
+#else
+#include "SDCardHAL.h"
+#endif
@@ -4,6 +4,27 @@
 // size of the fifo
 #define BUFFER_SIZE 512
 
+// static RAM, of the 2048 bytes of the atmega324pa, with the defaults below.
+// the globals of SDCard.cpp as avr-gcc lays them out, sdFat's from its source
+//   auxBuffer                        512
+//   handles (MAX_HANDLES 2)           88
+//   hashState, MD5_STEP's             88
+//   sdFat                             68
+//   trace ring (TRACE_SIZE 8)         72
+//   image map (MAX_IMAGE_EXTENTS 8)   64
+//   name index (DIR_INDEX_SIZE 64)    64
+//   instruction stats (STATS_SLOTS 8) 56
+//   hashFile                          30
+//   stats                             26
+//   argBuffer (ARG_BUFFER_SIZE)       24
+//   other globals                    111
+//   sdFat's block cache and statics  527
+//   zzjduino, avr-libc               ~10
+//   total                          ~1740, ~310 left for the stack
+// STATS reports how much of the stack was never used since reset. check
+// the static total with avr-size -C --mcu=atmega324pa after changing any of
+// the sizes.
+
 /*
                _____ _____
 		 PB0 -|     U     |- PA0  ADC0
@@ -176,7 +197,9 @@ Addresses:
 //###### THESE FUNCTIONS MAY BE USED AT ANY TIME WHEN CARD PRESENT
 
 // returns a directory listing of current directory
-// argument (optional): page to continue from, 0 or non present for first page
+// argument (optional): last page received, non present for first page
+// asking for the page after the last one returned continues from where it 
+// stopped; any other page is found by listing from the start
 // returns:
 // <page # 1b>
 // <name 1-12b>\0<size 4b>\0 (repeat until fifo empty)
@@ -187,7 +210,7 @@ Addresses:
 #define FILES_PER_DIR_PAGE 34
 // FILES_PER_DIR_PAGE = (int)((BUFFER_SIZE - 1) / 15)
 
-// opens file named by data in fifo
+// opens file named by data in fifo, in the selected handle (see SELECT)
 // arguments:
 // 1b mode
 // 1-12 bytes of filename, null terminated
@@ -206,9 +229,32 @@ Addresses:
 // error bit set if file not deleted
 #define DELETE		12
 
+// creates a file of a fixed size in one contiguous run of clusters and opens it
+// arguments:
+// 4b size in bytes
+// 1-12 bytes of filename, null terminated
+// error bit set if a file is open, the file exists or there is no contiguous space
+// the file is opened read/write at position 0 and is already its full size.
+// WRITEs of BUFFER_SIZE bytes at multiples of 512 within that size go straight
+// to the card with no FAT or directory updates. the contents of blocks that 
+// are never written are undefined.
+#define CREATE_CONTIGUOUS 34
+
+// selects the file handle that OPEN, CLOSE and all open file instructions use
+// argument: 1b handle, 0 - MAX_HANDLES - 1
+// returns:
+// 1b: previously selected handle
+// handle 0 is selected after reset. files stay open, at their position, while
+// another handle is selected. data staged for the old handle is written 
+// first; if that fails the error bit is set, but the new handle is selected.
+// a file must not be open for writing in more than one handle.
+#define SELECT		35
+#define MAX_HANDLES	2	// each costs about 43 bytes of RAM
+
 // closes open file, if any, and flushes buffers. 
 // argument: none
-// returns: none
+// returns: none, error bit set (WRITE_ERROR) if staged data, the FAT or the 
+// directory entry could not be written. the file is closed either way
 #define CLOSE		13
 
 // tests if file named by data in fifo exists
@@ -222,15 +268,48 @@ Addresses:
 // 16b: digest
 #define FILE_MD5	19
 
-// reads bench.txt as fast as possible locally
+// hashes a file, or part of the open file, a few blocks per instruction
+// so the bus is never held for long
+// argument: 1b step, followed by:
+// MD5_BEGIN_FILE: null-terminated filename, whole file is hashed
+// MD5_BEGIN_OPEN: 4b offset, 4b length - range of the open file
+// MD5_CONTINUE: 2b (optional) number of 512 byte blocks to hash, default 1
+// MD5_FINISH: nothing
 // returns:
-// 4b: bytes read (0xFFFFFFFF on fail)
-#define BENCH_READ  20
-
-// writes bench.txt as fast as possible locally - 2000 * WRITE_MAX_SZ
-// returns: 
-// 4b: bytes written (0xFFFFFFFF on fail)
-#define BENCH_WRITE 21
+// begin & continue: 4b bytes left to hash
+// finish: 4b bytes hashed, 16b digest
+// beginning a new hash discards any unfinished one. the hash keeps its state
+// in RAM of its own, other instructions can run between the steps.
+// hashing the open file does not move its position.
+#define MD5_STEP	31
+#define MD5_BEGIN_FILE	0
+#define MD5_BEGIN_OPEN	1
+#define MD5_CONTINUE	2
+#define MD5_FINISH		3
+
+// times reads and/or writes of a file on the card, nothing crosses the bus
+// arguments:
+// 1b: mode - BENCH_MODE_READ, BENCH_MODE_WRITE or BENCH_MODE_MIXED (alternating)
+// 1b: pattern - BENCH_SEQUENTIAL, or BENCH_RANDOM for block aligned random offsets
+// 2b: block size, 1 - BUFFER_SIZE
+// 4b: total bytes to transfer
+// null-terminated filename
+// random offsets, and reads, stay within the existing file; write it
+// sequentially first. writes are created if missing and synced before timing ends.
+// sequential BUFFER_SIZE blocks of a contiguous file use multi-block transfers.
+// returns:
+// 4b: elapsed us
+// 4b: bytes transferred (less than requested if end of file is reached)
+// 4b: fastest block, us
+// 4b: average block, us
+// 4b: slowest block, us
+// 4b: bytes per second
+#define BENCH		20
+#define BENCH_MODE_READ		0
+#define BENCH_MODE_WRITE	1
+#define BENCH_MODE_MIXED	2
+#define BENCH_SEQUENTIAL	0
+#define BENCH_RANDOM		1
 
 // enters directory named by null-terminated string in fifo
 // Special case:
@@ -238,6 +317,45 @@ Addresses:
 // error bit 0 on success, else 1 
 #define CHDIR		22
 
+// mounts a disk image for use with SECTOR_RELATIVE
+// the cluster chain is mapped once, so later sector accesses go straight to 
+// the card. the image must not be deleted or resized while mounted.
+// argument: null-terminated filename, or none to unmount
+// returns:
+// 4b: image size in sectors
+// 1b: number of fragments
+// error bit set if the file cannot be opened or has more than 
+// MAX_IMAGE_EXTENTS fragments
+#define MOUNT_IMAGE	29
+#define MAX_IMAGE_EXTENTS 8	// 8 bytes of RAM each
+
+// selects the sector used by READ_SECTOR and WRITE_SECTOR
+// arguments:
+// 4b: sector number (LBA)
+// 1b (optional): flags
+// with SECTOR_RELATIVE, sectors are relative to the mounted image and 
+// sectors past its end are rejected. otherwise sectors are absolute blocks 
+// of the card. open files should be flushed first.
+// error bit set if the sector is out of range
+#define SET_SECTOR	26
+#define SECTOR_RELATIVE	0x01
+
+// reads a whole sector, bypassing the filesystem
+// arguments (optional): same as SET_SECTOR, else the sector after the last one
+// returns:
+// 512b: sector data
+// consecutive sectors are read as one multi-block transfer
+#define READ_SECTOR	27
+
+// writes a whole sector, bypassing the filesystem
+// the sector must have been selected by SET_SECTOR or a previous READ_SECTOR
+// or WRITE_SECTOR, which advance to the next sector
+// argument: exactly 512 bytes of sector data
+// returns: none, error bit set on failure
+// consecutive sectors are written as one multi-block transfer. a failure
+// that only shows once it ends is reported by the next WRITE_SECTOR or FLUSH
+#define WRITE_SECTOR 28
+
 //###### THESE FUNCTIONS REQUIRE AN OPEN FILE
 
 // returns file length
@@ -266,20 +384,165 @@ Addresses:
 // argument (optional): number of bytes to read (default: READ_MAX_SZ)
 // returns:
 // 2b: number of bytes read or error bit set
+// with OPT_CRC the data is followed by 2b: CRC16 of the data
 #define READ		17
 #define READ_MAX_SZ (BUFFER_SIZE - 2)
+#define READ_CRC_MAX_SZ (BUFFER_SIZE - 4)	// READ_MAX_SZ when OPT_CRC is set
+
+// streams file data into the fifo in BUFFER_SIZE chunks
+// argument: 4b number of bytes to stream
+// returns:
+// <data, the requested number of bytes or up to end of file if that is nearer>
+// 1b: status - 0, or the error code that ended the read
+// 4b: number of bytes actually read from the file
+// bytes after an error are sent as 0. 0xFFFFFFFF reads to end of file
+//
+// each time busy goes low, drain the fifo until ~EMPT is 0, then write 
+// READ_STREAM to control again to receive the next chunk. writing any other
+// value ends the stream; that instruction is not executed.
+// the stream is complete once all data and the 5 byte trailer have been read.
+// starting at a multiple of 512 is fastest: whole blocks then go from the 
+// card to the fifo without being copied through RAM.
+#define READ_STREAM	24
+
+// reads bytes into fifo, PackBits encoded
+// argument (optional): 2b maximum number of file bytes to read (default: as many as fit)
+// returns:
+// <encoded data>
+// 1b: PACKED_END
+// 2b: number of file bytes the data decodes to
+// or error bit set if nothing could be read
+//
+// each encoded run starts with a header byte h:
+//   0 - 127:   h + 1 literal bytes follow
+//   129 - 255: the next byte is repeated 257 - h times
+// runs never cross PACKED_END, so the host decodes until it reads it. 
+// compressible data decodes to more than BUFFER_SIZE bytes per READ_PACKED;
+// incompressible data costs 1 extra byte per 128.
+#define READ_PACKED	30
+#define PACKED_END	0x80
 
 // writes entire contents of fifo to open file
 // argument: data bytes to read (max WRITE_MAX_SZ)
 // returns:
 // 2b: number of bytes written or error bit set
+// with OPT_WRITE_BEHIND the data is only staged in RAM when WRITE returns; 
+// a failure to commit it is reported by the next WRITE, FLUSH or CLOSE
+// with OPT_CRC the last 2 bytes of the argument are the CRC16 of the data 
+// before them; on a mismatch nothing is written and CRC_MISMATCH is set
 #define WRITE		18
 #define WRITE_MAX_SZ BUFFER_SIZE
 
+// writes a stream of data to the open file, received in fifo sized chunks
+// argument: 4b number of bytes to write, optionally followed by the first data
+// returns, once all bytes have been received:
+// 1b: status - 0, or the error code that stopped the writing
+// 4b: number of bytes written to the file
+//
+// each time busy goes low, fill the fifo with up to BUFFER_SIZE bytes and 
+// write WRITE_STREAM to control again to send them. busy stays high until
+// the AVR has taken everything out of the fifo. writing any other value ends
+// the stream; data already received is written, that instruction is not run.
+// after a write error the remaining bytes must still be sent, they are dropped.
+// chunks of any size are received straight into whole blocks, which go to
+// the card without being copied.
+#define WRITE_STREAM	36
+
+// commits any staged data and flushes buffers to the card, also ends a 
+// multi-block WRITE_SECTOR transfer. needs no open file for that
+// argument: none
+// returns: none, error bit set if staged data or sectors could not be written
+#define FLUSH		25
+
+// READ at a position, without a separate SEEK
+// argument: 4b position, 2b (optional) number of bytes to read
+// returns: as READ, or error bit set if the seek failed
+#define READ_AT		32
+
+// WRITE at a position, without a separate SEEK
+// argument: data bytes, then 4b position (max WRITE_MAX_SZ - 4 data bytes)
+// returns: as WRITE, or error bit set if the seek failed
+// the position goes last so the data is written from where it was received
+#define WRITE_AT	33
+
 //####### SPECIAL FUNCTIONS, NO SD REQUIRED
 
+// sets controller options
+// argument (optional): 1b new option bits
+// returns:
+// 1b: option bits now in effect
+#define OPTIONS		0x66
+#define OPT_READ_AHEAD	0x01	// prefetch files opened OPEN_READ between commands (default on)
+#define OPT_WRITE_BEHIND 0x02	// acknowledge WRITE once staged, commit it between commands
+#define OPT_CRC			0x04	// READ appends and WRITE checks a CRC16 of the data
+
+// runs several instructions in one transaction
+// argument: sub-commands, back to back, each:
+// 1b: length of its argument data
+// 1b: instruction
+// <argument data>
+// returns, for each sub-command that was run:
+// <its return data, or its error byte>
+// 1b: status - 0, or the error code if it failed
+// execution stops at the first failing sub-command and the error bit is set;
+// parse the response from its end in that case.
+// the return data of all sub-commands must fit in the fifo.
+// BATCH, READ_STREAM, WRITE_STREAM, FILE_MD5, MD5_STEP, BENCH and FIFO_BENCH
+// cannot be batched
+#define BATCH		0x65
+
+// returns controller statistics
+// argument (optional): 1b, nonzero to reset all counters after reading
+// returns:
+// 4b: millis() - time awake since reset
+// 4b: bytes of argument data received
+// 4b: bytes of return data sent
+// 2b: failed instructions
+// 2b: card read/write errors, including ones found during background work
+// 4b: ms spent awake waiting for the host (also counts READ_STREAM handoffs)
+// 2b: number of times the controller went into standby
+// 4b: ms spent on background work between instructions
+// 4b: slowest response, us from the host writing an instruction to reading it
+// 2b: bytes of stack never used since reset, 0 in the Linux build
+// 1b: number of instruction entries (STATS_SLOTS)
+// 7b per entry, unused entries have 0 calls:
+//   1b: instruction
+//   2b: times run, stops at 65535
+//   2b: total ms, stops at 65535
+//   2b: slowest run, ms
+// instructions run after all entries are taken are not counted individually.
+// reset the counters before they stop to keep the averages right
+#define STATS		0x63
+#define STATS_SLOTS	8	// 7 bytes of RAM each, 0 leaves per-instruction counts out
+
+// returns the most recent trace events, oldest first
+// argument (optional): 1b, nonzero to clear the trace after reading
+// returns:
+// 1b: number of events
+// 9b per event:
+//   1b: event (TRACE_*)
+//   1b: instruction being handled
+//   2b: TRACE_COMMAND: argument length; read/write errors: bytes done so far,
+//       0 for blocks the card failed to program as a multi-block write ended
+//   2b: millis() when the instruction started, low 16 bits
+//   1b: ms taken (255 = 255 or more)
+//   1b: error code of the instruction, 0 if none
+//   1b: last sdFat card error code
+#define TRACE_DUMP	0x64
+#define TRACE_COMMAND		1	// an instruction completed
+#define TRACE_READ_ERROR	2	// read failed without failing the instruction (READ_STREAM)
+#define TRACE_WRITE_ERROR	3	// staged write-behind data could not be written
+
+// returns cache counters
+// argument (optional): 1b, nonzero to reset counters after reading
+// returns:
+// 4b: read-ahead hits (READ served without touching the card)
+// 4b: read-ahead misses
+#define CACHE_STATS	0x67
+
 // CRC16 of data in fifo
 // return: 2b CRC16
+// all CRC16s are the same as avr-libc _crc16_update: poly 0xA001, initial value 0
 #define CRCTEST		0x68
 
 // returns 0xDEADBEEF
@@ -289,6 +552,18 @@ Addresses:
 // 0-512 bytes of data
 #define ECHO		0x6A
 
+// times the fifo routines in cpu cycles by filling the fifo and reading it
+// back, first with the burst loops and then with unchanged copies of the byte
+// at a time loops they replaced (fifo_writeptr_bytewise, fifo_ingest_bytewise)
+// argument: none, the fifo must be empty
+// returns:
+// 2b: cycles to write BUFFER_SIZE bytes with fifo_writeptr
+// 2b: cycles to read them back with fifo_ingest
+// 2b: cycles to write BUFFER_SIZE bytes with fifo_writeptr_bytewise
+// 2b: cycles to read them back with fifo_ingest_bytewise
+// 1b: 0, or 1 if any byte did not come back as written
+#define FIFO_BENCH	0x6B
+
 // soft-reset of uC
 // no return
 #define RESET		0x80
@@ -308,7 +583,10 @@ enum {
 	ERROR_NONEXISTANT_FILE,		// 137 
 	ERROR_OPERATION_FAILED,		// 138 - seek, delete
 	ERROR_SD_NOT_PRESENT,		// 139 - (any operation)
-	ERROR_UNKNOWN_INSTRUCTION   // 140
+	ERROR_UNKNOWN_INSTRUCTION,  // 140
+	ERROR_IMAGE_FRAGMENTED,		// 141 - mount_image
+	ERROR_NO_IMAGE,				// 142 - set_sector
+	ERROR_CRC_MISMATCH			// 143 - write
 };
 
 #ifdef SDCARD_CPP
@@ -334,45 +612,247 @@ enum {
 #define SW 4
 #define EMPTY 5
 
+// tracing: TRACE_OFF, TRACE_ERRORS (failed instructions and background 
+// errors) or TRACE_ALL (every instruction)
+#define TRACE_OFF		0
+#define TRACE_ERRORS	1
+#define TRACE_ALL		2
+
+#define TRACE_LEVEL		TRACE_ERRORS
+#define TRACE_SIZE		8	// events kept, power of 2, 9 bytes each
+
+#if TRACE_LEVEL > TRACE_OFF
+#define TRACE(ev, arg)	trace(ev, arg, millis())
+#else
+#define TRACE(ev, arg)
+#endif
+
+// card error that does not fail the current instruction
+#define SD_ERROR(ev, arg)	{ \
+								stats.sdErrors++; \
+								TRACE(ev, arg); \
+							}
+
 // function aliases
 
-#define _NOP		__asm("nop\n")
-#define fileOpen	openFile.isOpen()
+#define fileOpen	openFile->isOpen()
 #define fifo_write	fifo_write8
 
 #define SET_ERROR(x)	{ \
-							bset(PORTC, ERR_BIT); \
+							err_set(); \
+							lastError = ERROR_##x; \
 							fifo_write(ERROR_##x); \
 							return; \
 						}
 
 // function prototypes
 
+// hardware access, SDCardHAL.h or sim/SDCardHAL.h - the only functions that 
+// touch a port, SPI or timer register
+inline void hal_init();
+inline void err_set();
+inline void err_clear();
+inline bool err_is_set();
+inline void led_on();
+inline void led_off();
+inline uint16_t cycles_begin();
+inline void cycles_reset();
+inline uint16_t cycles_read();
+inline void cycles_end(uint16_t saved);
+inline bool hal_sleep(bool idle);
+
 inline void data_out();
 inline void data_tri();
 inline void data_in();
 
+inline bool ff_is_set();
+inline bool fifo_has_data();
+inline bool card_present();
+
 // must set port mode first
+inline byte ctrl_read();
+inline uint16_t fifo_ingest(byte * dst);
+inline uint16_t fifo_ingest_max(byte * dst, uint16_t max);
 inline byte fifo_read();
+inline void fifo_put(uint8_t b);
+inline void fifo_put_block(const byte * ptr, uint16_t count);
+inline uint16_t fifo_put_crc(const byte * ptr, uint16_t count, uint16_t crc);
+inline void fifo_writeptr_bytewise(void* p, uint16_t count);
+inline uint16_t fifo_ingest_bytewise(byte * dst);
+
+inline void fifo_reset();
+inline void ff_reset();
+
+inline bool spi_block_to_fifo();
+inline uint8_t spi_rec();
+
+inline void do_sleep();
+inline void enable_ctrl();
+inline void disable_ctrl();
+inline void do_reset();
+
+inline void stack_paint();
+inline uint16_t stack_unused();
+
+// bus protocol and output accounting, on top of the above
+inline void wait_for_command(bool jobs);
 inline void fifo_write8(uint8_t b);
 inline void fifo_write16(uint16_t p);
 inline void fifo_write32(uint32_t p);
 inline void fifo_writeptr(void* p, uint16_t count);
+inline uint16_t fifo_writeptr_crc(void* p, uint16_t count, uint16_t crc);
+
+inline uint16_t crc16(const byte * p, uint16_t count);
+
+// arguments of all instructions but those aux_args lists, the longest is 
+// BENCH's: 8 bytes and a 13 byte name. anything past this is dropped
+#define ARG_BUFFER_SIZE 24
+
+inline bool aux_args(uint8_t i);
 
 inline uint16_t readuint16(byte * buffer, int pos);
 inline uint32_t readuint32(byte * buffer, int pos);
 
-inline void fifo_reset();
-inline void ff_reset();
+inline bool stream_handoff();
+inline bool stream_wait();
+inline void stream_end();
+
+inline bool fifo_write_block(uint32_t block);
+inline bool file_block(uint32_t pos, uint32_t * block);
+
+inline int16_t file_fetch(uint16_t count);
+inline int16_t file_take(uint16_t count, byte ** p);
+inline int16_t aux_fill();
+inline uint16_t file_write(const byte * data, uint16_t count, uint32_t blocks);
+inline void file_sync();
+inline uint16_t pack_to_fifo(const byte * p, uint16_t count);
+inline void aux_settle();
+inline void handle_select(uint8_t h);
+
+inline bool fat_next(uint32_t cluster, uint32_t * next);
+inline uint32_t file_card_pos();
+inline uint32_t file_position();
+inline bool file_seek(uint32_t pos);
+inline void write_behind_flush();
+inline bool run_job();
+inline bool run_timers();
+inline bool timer_pending();
+
+inline uint32_t sector_block(uint32_t s);
+
+inline bool card_begin(uint8_t mode, uint32_t block, uint32_t count);
+inline void card_moved();
+inline bool card_read(uint32_t block, byte * dst);
+inline bool card_write(uint32_t block, const byte * src, uint32_t count);
+inline void card_abort();
+inline bool card_stop();
+inline bool card_end();
+
+// an open multi-block transfer is ended after this long without use
+#define CARD_IDLE_MS 100
+
+// written files are synced after this long without another write
+#define SYNC_IDLE_MS 1000
+
+// cardMode
+enum {
+	CARD_IDLE = 0,
+	CARD_READ,		// CMD18 open
+	CARD_WRITE		// CMD25 open
+};
 
-inline void do_sleep();
+inline uint8_t dir_lookup(const char * name, uint16_t * index);
+inline void dir_index_build();
+inline bool make83(const char * name, uint8_t * n83);
+inline uint8_t name_hash(const uint8_t * n83);
+
+// size of the name index of the working directory, 1 byte for each of its
+// first directory entries. every long file name takes up 2 or more. in a 
+// larger directory, names past the index are looked up by sdFat
+#define DIR_INDEX_SIZE 64
+
+// dir_lookup results
+enum {
+	NAME_FOUND = 0,
+	NAME_ABSENT,		// index covers the whole directory, name is not there
+	NAME_UNKNOWN		// index cannot tell, ask sdFat
+};
 
-inline void enable_ctrl();
-inline void disable_ctrl();
+// dirIndexState
+enum {
+	DIR_INDEX_INVALID = 0,
+	DIR_INDEX_COMPLETE,
+	DIR_INDEX_PARTIAL	// directory has more than DIR_INDEX_SIZE entries
+};
 
-inline void handle();
+// a file handle. the selected one's mode and contiguity live in globals
+typedef struct {
+	SdFile file;
+	uint8_t mode;
+	int8_t contig;
+	uint32_t firstBlock;
+	uint32_t chainIndex;
+	uint32_t chainCluster;
+} handle_t;
+
+// a run of contiguous card blocks in a mounted image
+typedef struct {
+	uint32_t sector;	// first image sector of the run
+	uint32_t block;		// card block holding that sector
+} extent_t;
+
+// one entry of the trace ring, as returned by TRACE_DUMP
+typedef struct {
+	uint8_t event;
+	uint8_t inst;
+	uint16_t arg;
+	uint16_t time;
+	uint8_t ms;
+	uint8_t err;
+	uint8_t sdErr;
+} trace_t;
+
+inline void trace(uint8_t event, uint16_t arg, uint16_t start);
+
+// STATS counters, sent as laid out here
+typedef struct {
+	uint32_t bytesIn;
+	uint32_t bytesOut;
+	uint16_t failed;
+	uint16_t sdErrors;
+	uint32_t idleMs;
+	uint16_t sleeps;
+	uint32_t backgroundMs;
+	uint32_t latencyMaxUs;
+} stats_t;
+
+typedef struct {
+	uint8_t inst;
+	uint16_t calls;
+	uint16_t totalMs;
+	uint16_t maxMs;
+} inst_stats_t;
+
+inline void stats_record(uint16_t len, uint16_t start);
+
+// what MD5_STEP is hashing
+enum {
+	HASH_NONE = 0,
+	HASH_FILE,		// hashFile, opened by name
+	HASH_OPEN		// range of openFile
+};
 
-inline void do_reset();
+inline void hash_end();
+
+// what the aux buffer currently holds
+enum {
+	AUX_IDLE = 0,
+	AUX_READ_AHEAD,		// data prefetched from openFile, not yet read by the host
+	AUX_WRITE_BEHIND,	// data acknowledged to the host, not yet written to openFile
+	AUX_BATCH			// sub-commands of the running BATCH
+};
+
+inline void handle();
 
 #endif
 #endif
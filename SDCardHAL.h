@@ -0,0 +1,375 @@
+// hardware access for the board: the ports, the SPI data register and timer 1
+// are only touched here. SDCard.cpp includes this at its end, the Linux build
+// includes sim/SDCardHAL.h instead, which has the same functions
+
+#define _NOP		__asm("nop\n")
+
+// ports, SPI, the command and reset interrupts and the millis timer
+inline void hal_init() {
+	MCUSR = 0; // required for wdt_disable to actually work
+	wdt_disable();
+	
+	// set up output port
+	PORTC = bits(REG_CS, LED, IOW, IOR, FF_RESET, FIFO_RESET);
+	DDRC = bits(REG_CS, ERR_BIT, LED, IOW, IOR, FF_RESET, FIFO_RESET);
+	
+	// turn on SPI
+	SPCR = bits(SPE0, MSTR0);
+	
+	// set up interrupt 0 & 1
+	// int1 on rising edge (ISCn1 = 1, ISCn0 = 1)
+	// int0 on falling edge (ISCn1 = 1, ISCn0 = 0);
+	EICRA |= bits(ISC11, ISC01, ISC00); 
+	EIMSK |= bits(INT1, INT0); // enable interrupt 1 (soft reset) and 0 (command)
+	
+	// start millis timer
+	millis_start();
+	
+	sei(); // interrupts on
+	set_sleep_mode(SLEEP_MODE_STANDBY);
+}
+
+// the error bit the host reads, and the activity LED
+inline void err_set() {
+	bset(PORTC, ERR_BIT);
+}
+
+inline void err_clear() {
+	bclr(PORTC, ERR_BIT);
+}
+
+inline bool err_is_set() {
+	return bisset(PORTC, ERR_BIT);
+}
+
+inline void led_on() {
+	bset(PORTC, LED);
+}
+
+inline void led_off() {
+	bclr(PORTC, LED);
+}
+
+// timer 1 counting cpu cycles, for FIFO_BENCH. cycles_begin returns the 
+// timer's settings for cycles_end to put back
+inline uint16_t cycles_begin() {
+	uint16_t saved = TCCR1A | (TCCR1B << 8);
+	
+	TCCR1A = 0;
+	TCCR1B = bits(CS10);
+	
+	return saved;
+}
+
+inline void cycles_reset() {
+	TCNT1 = 0;
+}
+
+inline uint16_t cycles_read() {
+	return TCNT1;
+}
+
+inline void cycles_end(uint16_t saved) {
+	TCCR1A = saved;
+	TCCR1B = saved >> 8;
+}
+
+// sleep until INT0, unless Q is already high. idle mode keeps the millis tick
+// running, standby does not. returns false if Q was high and it did not sleep
+inline bool hal_sleep(bool idle) {
+	cli(); // Q rising from here on stays pending and wakes the sleep
+	
+	if (ff_is_set()) {
+		sei();
+		return false;
+	}
+	
+	set_sleep_mode(idle ? SLEEP_MODE_IDLE : SLEEP_MODE_STANDBY);
+	do_sleep(); // turns interrupts back on
+	
+	return true;
+}
+
+// clock the next data block of a started read out of the card, straight into the fifo
+// the next SPI transfer runs while the current byte is written to the fifo
+inline bool spi_block_to_fifo() {
+	uint16_t start = millis();
+	uint8_t b;
+	
+	// wait for start of data
+	while ((b = spi_rec()) == 0xFF)
+		if ((uint16_t)millis() - start > SD_READ_TIMEOUT)
+			return false;
+	
+	if (b != DATA_START_BLOCK)
+		return false;
+	
+	SPDR = 0xFF;
+	
+	for (uint16_t i = 0; i < 511; i++) {
+		while (!bisset(SPSR, SPIF)) ;
+		b = SPDR;
+		SPDR = 0xFF;
+		fifo_put(b);
+	}
+	
+	while (!bisset(SPSR, SPIF)) ;
+	fifo_put(SPDR);
+	
+	// discard crc
+	spi_rec();
+	spi_rec();
+	
+	return true;
+}
+
+inline uint8_t spi_rec() {
+	SPDR = 0xFF;
+	while (!bisset(SPSR, SPIF)) ;
+	return SPDR;
+}
+
+inline bool ff_is_set() {
+	return bisset(PIND, Q);
+}
+
+inline bool fifo_has_data() {
+	return bisset(PIND, EMPTY); // ~empty INACTIVE
+}
+
+inline bool card_present() {
+	return !bisset(PORTD, SW);
+}
+
+// read the instruction byte from the '373
+// must set port mode first
+inline byte ctrl_read() {
+	byte tmp;
+	
+	// could move the clr to be the first thing and remove nops
+	// but this is better for the sake of readability
+	bclr(PORTC, REG_CS);
+	_NOP;
+	_NOP;
+	tmp = PINA;
+	bset(PORTC, REG_CS);
+	
+	return tmp;
+}
+
+// read the entire fifo contents into dst, returns count of bytes read
+// must set port mode first
+inline uint16_t fifo_ingest(byte * dst) {
+	byte * p = dst;
+	uint8_t mask = bv(IOR);
+	uint8_t tmp;
+	
+	// 8 cycles per byte, counted. writing PINC toggles ~IOR; the previous byte is stored
+	// while it is low, which covers the AVR sync circuit (1.5 cycles) before PINA is read
+	asm volatile (
+		"	sbis %[pind], %[empty]	\n\t" // nothing to read
+		"	rjmp 3f					\n\t"
+		"	out  %[pinc], %[mask]	\n\t" // ~IOR low
+		"	rjmp 2f					\n\t" // same delay as the st below
+		"1:	out  %[pinc], %[mask]	\n\t" // ~IOR low
+		"	st   %a[ptr]+, %[tmp]	\n\t" // store previous byte
+		"2:	in   %[tmp], %[pina]	\n\t"
+		"	out  %[pinc], %[mask]	\n\t" // ~IOR high
+		"	sbic %[pind], %[empty]	\n\t" // ~empty still inactive?
+		"	rjmp 1b					\n\t"
+		"	st   %a[ptr]+, %[tmp]	\n\t" // last byte
+		"3:							\n\t"
+		: [ptr] "+e" (p), [tmp] "=&r" (tmp)
+		: [mask] "r" (mask), [pina] "I" (_SFR_IO_ADDR(PINA)), [pinc] "I" (_SFR_IO_ADDR(PINC)), 
+		  [pind] "I" (_SFR_IO_ADDR(PIND)), [empty] "I" (EMPTY)
+		: "memory"
+	);
+	
+	return p - dst;
+}
+
+// fifo_ingest that stops after max bytes, the rest stays in the fifo
+// must set port mode first
+inline uint16_t fifo_ingest_max(byte * dst, uint16_t max) {
+	uint16_t n = 0;
+	
+	while (n < max && bisset(PIND, EMPTY)) // ~empty INACTIVE
+		dst[n++] = fifo_read();
+	
+	return n;
+}
+
+// strobe one byte into the fifo
+// must set port mode first
+inline void fifo_put(uint8_t b) {
+	PORTA = b;
+	bclr(PORTC,IOW);
+	bset(PORTC,IOW);
+}
+
+inline void fifo_put_block(const byte * ptr, uint16_t count) {
+	uint16_t blocks = count >> 2;
+	uint8_t mask = bv(IOW);
+	uint8_t tmp;
+	
+	// 4 bytes per pass, 6 cycles per byte counted from the instruction timings.
+	// writing PINC toggles ~IOW; the next byte is loaded while it is low, so
+	// the strobe stays 2 cycles wide
+	if (blocks)
+		asm volatile (
+			"1:	ld   %[tmp], %a[ptr]+	\n\t"
+			"	out  %[porta], %[tmp]	\n\t"
+			"	out  %[pinc], %[mask]	\n\t"
+			"	ld   %[tmp], %a[ptr]+	\n\t"
+			"	out  %[pinc], %[mask]	\n\t"
+			"	out  %[porta], %[tmp]	\n\t"
+			"	out  %[pinc], %[mask]	\n\t"
+			"	ld   %[tmp], %a[ptr]+	\n\t"
+			"	out  %[pinc], %[mask]	\n\t"
+			"	out  %[porta], %[tmp]	\n\t"
+			"	out  %[pinc], %[mask]	\n\t"
+			"	ld   %[tmp], %a[ptr]+	\n\t"
+			"	out  %[pinc], %[mask]	\n\t"
+			"	out  %[porta], %[tmp]	\n\t"
+			"	out  %[pinc], %[mask]	\n\t"
+			"	sbiw %[cnt], 1			\n\t"
+			"	out  %[pinc], %[mask]	\n\t"
+			"	brne 1b					\n\t"
+			: [ptr] "+e" (ptr), [cnt] "+w" (blocks), [tmp] "=&r" (tmp)
+			: [mask] "r" (mask), [porta] "I" (_SFR_IO_ADDR(PORTA)), [pinc] "I" (_SFR_IO_ADDR(PINC))
+			: "memory"
+		);
+	
+	for (count &= 3; count; count--)
+		fifo_put(*ptr++);
+}
+
+// fifo_put_block that also returns the CRC16 of the bytes written, continuing
+// from crc. the table lookup for each byte runs while its ~IOW strobe is out,
+// so the CRC costs a few cycles per byte over a plain fifo_put
+inline uint16_t fifo_put_crc(const byte * ptr, uint16_t count, uint16_t crc) {
+	while (count--) {
+		uint8_t b = *ptr++;
+		
+		PORTA = b;
+		bclr(PORTC,IOW);
+		crc = (crc >> 8) ^ pgm_read_word(&crc16Table[(uint8_t)crc ^ b]);
+		bset(PORTC,IOW);
+	}
+	
+	return crc;
+}
+
+inline void do_sleep() {
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+}
+
+inline void do_reset() {
+	data_tri();
+	disable_ctrl();
+	wdt_enable(WDTO_15MS);
+	while(true) ;
+}
+
+// stack gauge: the RAM between the globals and the stack is painted before 
+// interrupts are on, what is still painted later was never used by the stack
+#define STACK_PAINT 0xC5
+
+extern uint8_t __heap_start; // end of the globals, from the linker script
+
+inline void stack_paint() {
+	for (uint8_t * p = &__heap_start; p < (uint8_t *)SP; p++)
+		*p = STACK_PAINT;
+}
+
+inline uint16_t stack_unused() {
+	uint8_t * p = &__heap_start;
+	
+	while (p < (uint8_t *)SP && *p == STACK_PAINT)
+		p++;
+	
+	return p - &__heap_start;
+}
+
+inline void disable_ctrl() {
+	DDRC &= ~(bv(IOW) | bv(IOR));
+	bclr(PORTC, IOW); // set these after changing input direction so lines are not
+	bclr(PORTC, IOR); // set low at any point in time
+}
+
+inline void enable_ctrl() {
+	bset(PORTC, IOW); // set port first so that the lines are not pulled low 
+	bset(PORTC, IOR); // when output direction is changed
+	DDRC |= bv(IOW) | bv(IOR);
+}
+
+inline void ff_reset() {
+	bclr(PORTC, FF_RESET);
+	bset(PORTC, FF_RESET);	
+}
+
+inline void fifo_reset() {
+	bclr(PORTC, FIFO_RESET);
+	bset(PORTC, FIFO_RESET);
+}
+
+inline byte fifo_read() {
+	byte tmp;
+	
+	bclr(PORTC, IOR);
+	_NOP; _NOP; // wait for valid data - AVR sync circuit (1.5 cycles)
+	tmp = PINA;
+	bset(PORTC, IOR);
+	
+	return tmp;
+}
+
+// the byte at a time loops fifo_writeptr and the command loop used before the 
+// burst routines, unchanged. only FIFO_BENCH runs them, as its baseline
+inline void fifo_writeptr_bytewise(void* p, uint16_t count) {
+	byte * ptr = (byte*)p;
+	
+	for (uint16_t i = 0; i < count; i++) {
+		PORTA = ptr[i];
+		bclr(PORTC,IOW);
+		bset(PORTC,IOW);
+	}
+}
+
+inline uint16_t fifo_ingest_bytewise(byte * dst) {
+	int16_t n = 0;
+	
+	if (bisset(PIND, EMPTY)) {
+		n = -1;
+		
+		while (bisset(PIND, EMPTY)) { // ~empty INACTIVE
+			bclr(PORTC, IOR);
+			n++;	// do something productive while waiting for AVR sync circuit
+			_NOP;
+			dst[n] = PINA;
+			bset(PORTC, IOR);
+		}
+		
+		n++;
+	}
+	
+	return n;
+}
+
+inline void data_out() {
+	DDRA = 0xFF; // all input 
+}
+
+inline void data_in() {
+	data_tri();
+	_NOP;  // syncronization
+	_NOP;
+}
+
+inline void data_tri() {
+	DDRA = 0;  // input mode
+	PORTA = 0; // all pull ups off
+}
@@ -0,0 +1,175 @@
+// hardware access for the Linux build, same functions as SDCardHAL.h on top
+// of the simulated bus in SimBus.h. the ports, data direction and strobes
+// have nothing to model, those functions are empty
+
+#include "SimBus.h"
+
+inline void hal_init() {
+}
+
+inline void err_set() {
+	simBus.err = true;
+}
+
+inline void err_clear() {
+	simBus.err = false;
+}
+
+inline bool err_is_set() {
+	return simBus.err;
+}
+
+inline void led_on() {
+	simBus.led = true;
+}
+
+inline void led_off() {
+	simBus.led = false;
+}
+
+// there is no cycle counter to read, FIFO_BENCH returns 0 cycles
+inline uint16_t cycles_begin() {
+	return 0;
+}
+
+inline void cycles_reset() {
+}
+
+inline uint16_t cycles_read() {
+	return 0;
+}
+
+inline void cycles_end(uint16_t) {
+}
+
+inline bool hal_sleep(bool idle) {
+	return simBus.waitQ(idle);
+}
+
+// the next data block of a started read, into the fifo
+inline bool spi_block_to_fifo() {
+	uint8_t block[BUFFER_SIZE];
+	
+	if (!sdFat.card()->readData(block))
+		return false;
+	
+	for (uint16_t i = 0; i < BUFFER_SIZE; i++)
+		simBus.put(block[i]);
+	
+	return true;
+}
+
+inline uint8_t spi_rec() {
+	return 0xFF;
+}
+
+inline bool ff_is_set() {
+	return simBus.q();
+}
+
+inline bool fifo_has_data() {
+	return simBus.count() != 0;
+}
+
+inline bool card_present() {
+	return simBus.cardIn;
+}
+
+inline byte ctrl_read() {
+	return simBus.reg();
+}
+
+inline uint16_t fifo_ingest(byte * dst) {
+	byte * p = dst;
+	
+	while (simBus.get(p))
+		p++;
+	
+	return p - dst;
+}
+
+inline uint16_t fifo_ingest_max(byte * dst, uint16_t max) {
+	uint16_t n = 0;
+	
+	while (n < max && simBus.get(dst + n))
+		n++;
+	
+	return n;
+}
+
+inline void fifo_put(uint8_t b) {
+	simBus.put(b);
+}
+
+inline void fifo_put_block(const byte * ptr, uint16_t count) {
+	while (count--)
+		simBus.put(*ptr++);
+}
+
+inline uint16_t fifo_put_crc(const byte * ptr, uint16_t count, uint16_t crc) {
+	while (count--) {
+		uint8_t b = *ptr++;
+		
+		simBus.put(b);
+		crc = (crc >> 8) ^ pgm_read_word(&crc16Table[(uint8_t)crc ^ b]);
+	}
+	
+	return crc;
+}
+
+inline void do_sleep() {
+	simBus.waitQ(false);
+}
+
+// the bench never sends RESET, there is no watchdog to restart the firmware
+inline void do_reset() {
+	fprintf(stderr, "sim: RESET is not simulated\n");
+	abort();
+}
+
+// the stack is the host process's, there is nothing to measure
+inline void stack_paint() {
+}
+
+inline uint16_t stack_unused() {
+	return 0;
+}
+
+inline void disable_ctrl() {
+}
+
+inline void enable_ctrl() {
+}
+
+inline void ff_reset() {
+	simBus.ffReset();
+}
+
+inline void fifo_reset() {
+	simBus.reset();
+}
+
+inline byte fifo_read() {
+	byte b = 0xFF;
+	
+	simBus.get(&b);
+	
+	return b;
+}
+
+inline void fifo_writeptr_bytewise(void * p, uint16_t count) {
+	fifo_put_block((byte *)p, count);
+}
+
+inline uint16_t fifo_ingest_bytewise(byte * dst) {
+	return fifo_ingest(dst);
+}
+
+inline void data_out() {
+}
+
+inline void data_in() {
+}
+
+inline void data_tri() {
+}
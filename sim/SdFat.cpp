@@ -0,0 +1,1075 @@
+// SdFat stand-in for the Linux build, see include/SdFat.h. follows the
+// library's own logic closely enough that the firmware makes the same
+// calls in the same order, and so sends the card the same commands
+
+#include <string.h>
+
+#include <SdFat.h>
+
+#include "SimCard.h"
+
+static uint16_t get16(const uint8_t * p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t * p) {
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+//////////////////////////////////////////////////////////////
+// Sd2Card
+
+bool Sd2Card::init(uint8_t, uint8_t) {
+	errorCode_ = 0;
+	state_ = IDLE;
+	
+	return sim_card_blocks() != 0;
+}
+
+bool Sd2Card::fail(uint8_t error) {
+	errorCode_ = error;
+	return false;
+}
+
+// a command sent in the middle of a multi-block transfer would be taken as
+// data, or ignored, by a real card
+bool Sd2Card::idle(uint8_t error) {
+	if (state_ == IDLE)
+		return true;
+	
+	simCardCounts.violations++;
+	
+	return fail(error);
+}
+
+uint32_t Sd2Card::cardSize() {
+	return idle(SD_CARD_ERROR_BUSY) ? sim_card_blocks() : 0;
+}
+
+bool Sd2Card::readBlock(uint32_t block, uint8_t * dst) {
+	if (!idle(SD_CARD_ERROR_CMD17))
+		return false;
+	
+	simCardCounts.cmd17++;
+	sim_spin(simCardTiming.access + simCardTiming.block);
+	
+	if (!sim_card_read(block, dst))
+		return fail(SD_CARD_ERROR_CMD17);
+	
+	simCardCounts.blocksRead++;
+	
+	return true;
+}
+
+bool Sd2Card::readStart(uint32_t block) {
+	if (!idle(SD_CARD_ERROR_CMD18))
+		return false;
+	
+	simCardCounts.cmd18++;
+	
+	if (block >= sim_card_blocks())
+		return fail(SD_CARD_ERROR_CMD18);
+	
+	state_ = READING;
+	block_ = block;
+	sim_spin(simCardTiming.access);
+	
+	return true;
+}
+
+bool Sd2Card::readData(uint8_t * dst) {
+	if (state_ != READING) {
+		simCardCounts.violations++;
+		return fail(SD_CARD_ERROR_READ);
+	}
+	
+	sim_spin(simCardTiming.block);
+	
+	if (!sim_card_read(block_, dst))
+		return fail(SD_CARD_ERROR_READ);
+	
+	block_++;
+	simCardCounts.blocksRead++;
+	
+	return true;
+}
+
+bool Sd2Card::readStop() {
+	if (state_ != READING) {
+		simCardCounts.violations++;
+		return fail(SD_CARD_ERROR_CMD12);
+	}
+	
+	simCardCounts.cmd12++;
+	state_ = IDLE;
+	
+	return true;
+}
+
+bool Sd2Card::writeBlock(uint32_t block, const uint8_t * src) {
+	if (!idle(SD_CARD_ERROR_CMD24))
+		return false;
+	
+	simCardCounts.cmd24++;
+	sim_spin(simCardTiming.block + simCardTiming.program);
+	
+	if (!sim_card_write(block, src))
+		return fail(SD_CARD_ERROR_WRITE);
+	
+	simCardCounts.blocksWritten++;
+	
+	return true;
+}
+
+bool Sd2Card::writeStart(uint32_t block, uint32_t eraseCount) {
+	if (!idle(SD_CARD_ERROR_CMD25))
+		return false;
+	
+	simCardCounts.cmd25++;
+	
+	if (block >= sim_card_blocks())
+		return fail(SD_CARD_ERROR_CMD25);
+	
+	state_ = WRITING;
+	block_ = block;
+	eraseEnd_ = block + eraseCount;
+	
+	return true;
+}
+
+bool Sd2Card::writeData(const uint8_t * src) {
+	if (state_ != WRITING) {
+		simCardCounts.violations++;
+		return fail(SD_CARD_ERROR_WRITE_MULTIPLE);
+	}
+	
+	sim_spin(simCardTiming.block + simCardTiming.programMulti);
+	
+	if (!sim_card_write(block_, src))
+		return fail(SD_CARD_ERROR_WRITE_MULTIPLE);
+	
+	block_++;
+	simCardCounts.blocksWritten++;
+	
+	return true;
+}
+
+// blocks pre-erased by ACMD23 and never written are undefined on a real
+// card. they are left erased here, so data that was relied on shows up wrong
+bool Sd2Card::writeStop() {
+	if (state_ != WRITING) {
+		simCardCounts.violations++;
+		return fail(SD_CARD_ERROR_STOP_TRAN);
+	}
+	
+	uint8_t erased[512];
+	
+	memset(erased, 0xFF, sizeof(erased));
+	
+	for (; block_ < eraseEnd_ && block_ < sim_card_blocks(); block_++) {
+		sim_card_write(block_, erased);
+		simCardCounts.erased++;
+	}
+	
+	state_ = IDLE;
+	sim_spin(simCardTiming.program);
+	
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+// SdVolume
+
+cache_t SdVolume::cacheBuffer_;
+uint32_t SdVolume::cacheBlockNumber_ = 0xFFFFFFFF;
+Sd2Card * SdVolume::sdCard_;
+bool SdVolume::cacheDirty_ = false;
+uint32_t SdVolume::cacheMirrorBlock_ = 0;
+
+// a volume at block 0, or in the first partition
+bool SdVolume::init(Sd2Card * dev) {
+	uint32_t volumeStart = 0;
+	
+	sdCard_ = dev;
+	fatType_ = 0;
+	allocSearchStart_ = 2;
+	cacheDirty_ = false;
+	cacheMirrorBlock_ = 0;
+	cacheBlockNumber_ = 0xFFFFFFFF;
+	
+	cache_t * pc = cacheFetch(0, CACHE_FOR_READ);
+	
+	if (!pc)
+		return false;
+	
+	if (pc->data[0] != 0xEB && pc->data[0] != 0xE9) {
+		volumeStart = get32(pc->data + 446 + 8);
+		
+		if (!pc->data[446 + 4] || !(pc = cacheFetch(volumeStart, CACHE_FOR_READ)))
+			return false;
+	}
+	
+	uint8_t * bpb = pc->data;
+	
+	if (get16(bpb + 11) != 512 || !bpb[13] || !bpb[16] || !get16(bpb + 14))
+		return false;
+	
+	blocksPerCluster_ = bpb[13];
+	
+	for (clusterSizeShift_ = 0; (1 << clusterSizeShift_) != blocksPerCluster_; clusterSizeShift_++)
+		if (clusterSizeShift_ > 7)
+			return false;
+	
+	fatCount_ = bpb[16];
+	blocksPerFat_ = get16(bpb + 22) ? get16(bpb + 22) : get32(bpb + 36);
+	fatStartBlock_ = volumeStart + get16(bpb + 14);
+	rootDirEntryCount_ = get16(bpb + 17);
+	rootDirStart_ = fatStartBlock_ + fatCount_ * blocksPerFat_;
+	dataStartBlock_ = rootDirStart_ + ((32 * rootDirEntryCount_ + 511) >> 9);
+	
+	uint32_t totalBlocks = get16(bpb + 19) ? get16(bpb + 19) : get32(bpb + 32);
+	
+	clusterCount_ = (totalBlocks - (dataStartBlock_ - volumeStart)) >> clusterSizeShift_;
+	
+	if (clusterCount_ < 4085)
+		return false; // FAT12, as SdFat
+	
+	if (clusterCount_ < 65525)
+		fatType_ = 16;
+	else {
+		fatType_ = 32;
+		rootDirStart_ = get32(bpb + 44);
+	}
+	
+	return true;
+}
+
+cache_t * SdVolume::cacheClear() {
+	if (!cacheFlush())
+		return 0;
+	
+	cacheBlockNumber_ = 0xFFFFFFFF;
+	
+	return &cacheBuffer_;
+}
+
+cache_t * SdVolume::cacheFetch(uint32_t block, uint8_t options) {
+	if (cacheBlockNumber_ != block) {
+		if (!cacheFlush())
+			return 0;
+		
+		if (options == CACHE_RESERVE_FOR_WRITE)
+			memset(cacheBuffer_.data, 0, 512);
+		else if (!sdCard_->readBlock(block, cacheBuffer_.data))
+			return 0;
+		
+		cacheBlockNumber_ = block;
+	}
+	
+	if (options != CACHE_FOR_READ)
+		cacheDirty_ = true;
+	
+	return &cacheBuffer_;
+}
+
+bool SdVolume::cacheFlush() {
+	if (cacheDirty_) {
+		if (!sdCard_->writeBlock(cacheBlockNumber_, cacheBuffer_.data))
+			return false;
+		
+		if (cacheMirrorBlock_ && !sdCard_->writeBlock(cacheMirrorBlock_, cacheBuffer_.data))
+			return false;
+		
+		cacheMirrorBlock_ = 0;
+		cacheDirty_ = false;
+	}
+	
+	return true;
+}
+
+bool SdVolume::chainSize(uint32_t cluster, uint32_t * size) {
+	uint32_t s = 0;
+	
+	do {
+		if (!fatGet(cluster, &cluster))
+			return false;
+		
+		s += 512UL << clusterSizeShift_;
+	} while (!isEOC(cluster));
+	
+	*size = s;
+	
+	return true;
+}
+
+bool SdVolume::fatGet(uint32_t cluster, uint32_t * value) {
+	if (cluster > clusterCount_ + 1)
+		return false;
+	
+	uint32_t block = fatStartBlock_ + (fatType_ == 16 ? cluster >> 8 : cluster >> 7);
+	cache_t * pc = cacheFetch(block, CACHE_FOR_READ);
+	
+	if (!pc)
+		return false;
+	
+	if (fatType_ == 16)
+		*value = pc->fat16[cluster & 0xFF];
+	else
+		*value = pc->fat32[cluster & 0x7F] & 0x0FFFFFFF;
+	
+	return true;
+}
+
+bool SdVolume::fatPut(uint32_t cluster, uint32_t value) {
+	if (cluster < 2 || cluster > clusterCount_ + 1)
+		return false;
+	
+	uint32_t block = fatStartBlock_ + (fatType_ == 16 ? cluster >> 8 : cluster >> 7);
+	cache_t * pc = cacheFetch(block, CACHE_FOR_WRITE);
+	
+	if (!pc)
+		return false;
+	
+	if (fatType_ == 16)
+		pc->fat16[cluster & 0xFF] = value;
+	else
+		pc->fat32[cluster & 0x7F] = (pc->fat32[cluster & 0x7F] & 0xF0000000) | (value & 0x0FFFFFFF);
+	
+	if (fatCount_ > 1)
+		cacheMirrorBlock_ = block + blocksPerFat_;
+	
+	return true;
+}
+
+bool SdVolume::freeChain(uint32_t cluster) {
+	uint32_t next;
+	
+	do {
+		if (!fatGet(cluster, &next) || !fatPut(cluster, 0))
+			return false;
+		
+		if (cluster < allocSearchStart_)
+			allocSearchStart_ = cluster;
+		
+		cluster = next;
+	} while (!isEOC(cluster));
+	
+	return true;
+}
+
+// count free clusters in a row, starting after *curCluster if it is set
+// so that a growing file stays contiguous
+bool SdVolume::allocContiguous(uint32_t count, uint32_t * curCluster) {
+	uint32_t bgnCluster;
+	uint32_t endCluster;
+	uint32_t fatEnd = clusterCount_ + 1;
+	bool setStart;
+	
+	if (*curCluster) {
+		bgnCluster = *curCluster + 1;
+		setStart = false;
+	} else {
+		bgnCluster = allocSearchStart_;
+		setStart = (count == 1);
+	}
+	
+	endCluster = bgnCluster;
+	
+	for (uint32_t n = 0;; n++, endCluster++) {
+		if (n >= clusterCount_)
+			return false;
+		
+		if (endCluster > fatEnd)
+			bgnCluster = endCluster = 2;
+		
+		uint32_t f;
+		
+		if (!fatGet(endCluster, &f))
+			return false;
+		
+		if (f != 0)
+			bgnCluster = endCluster + 1;
+		else if (endCluster - bgnCluster + 1 == count)
+			break;
+	}
+	
+	if (!fatPutEOC(endCluster))
+		return false;
+	
+	for (; endCluster > bgnCluster; endCluster--)
+		if (!fatPut(endCluster - 1, endCluster))
+			return false;
+	
+	if (*curCluster && !fatPut(*curCluster, bgnCluster))
+		return false;
+	
+	*curCluster = bgnCluster;
+	
+	if (setStart)
+		allocSearchStart_ = bgnCluster + 1;
+	
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+// SdBaseFile
+
+SdBaseFile * SdBaseFile::cwd_ = 0;
+
+// entries the sim creates are dated 2012-01-01
+static uint16_t const SIM_DATE = ((2012 - 1980) << 9) | (1 << 5) | 1;
+
+bool SdBaseFile::openRoot(SdVolume * vol) {
+	if (isOpen())
+		return false;
+	
+	if (vol->fatType() == 16) {
+		type_ = FAT_FILE_TYPE_ROOT_FIXED;
+		firstCluster_ = 0;
+		fileSize_ = 32 * vol->rootDirEntryCount();
+	} else if (vol->fatType() == 32) {
+		type_ = FAT_FILE_TYPE_ROOT32;
+		firstCluster_ = vol->rootDirStart();
+		
+		if (!vol->chainSize(firstCluster_, &fileSize_))
+			return false;
+	} else
+		return false;
+	
+	vol_ = vol;
+	flags_ = O_READ;
+	curCluster_ = 0;
+	curPosition_ = 0;
+	dirBlock_ = 0;
+	dirIndex_ = 0;
+	
+	return true;
+}
+
+bool SdBaseFile::open(const char * path, uint8_t oflag) {
+	return open(cwd_, path, oflag);
+}
+
+bool SdBaseFile::make83Name(const char * str, uint8_t * name, const char ** ptr) {
+	uint8_t n = 7;	// max index of the part being filled
+	uint8_t i = 0;
+	
+	memset(name, ' ', 11);
+	
+	while (*str != '\0' && *str != '/') {
+		uint8_t c = *str++;
+		
+		if (c == '.') {
+			if (n == 10)
+				return false; // only one dot
+			
+			n = 10;
+			i = 8;
+		} else {
+			if (strchr("|<>^+=?/[];,*\"\\", c) || i > n || c < 0x21 || c > 0x7E)
+				return false;
+			
+			name[i++] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+		}
+	}
+	
+	*ptr = str;
+	
+	return name[0] != ' ';
+}
+
+bool SdBaseFile::open(SdBaseFile * dirFile, const char * path, uint8_t oflag) {
+	uint8_t dname[11];
+	SdBaseFile dir1, dir2;
+	SdBaseFile * parent = dirFile;
+	SdBaseFile * sub = &dir1;
+	
+	if (!dirFile || isOpen())
+		return false;
+	
+	if (*path == '/') {
+		while (*path == '/')
+			path++;
+		
+		if (!dirFile->isRoot()) {
+			if (!dir2.openRoot(dirFile->vol_))
+				return false;
+			
+			parent = &dir2;
+		}
+	}
+	
+	for (;;) {
+		if (!make83Name(path, dname, &path))
+			return false;
+		
+		while (*path == '/')
+			path++;
+		
+		if (!*path)
+			break;
+		
+		if (!sub->open(parent, dname, O_READ))
+			return false;
+		
+		parent = sub;
+		sub = (parent != &dir1) ? &dir1 : &dir2;
+		sub->type_ = FAT_FILE_TYPE_CLOSED;
+	}
+	
+	return open(parent, dname, oflag);
+}
+
+bool SdBaseFile::open(SdBaseFile * dirFile, const uint8_t dname[11], uint8_t oflag) {
+	bool emptyFound = false;
+	dir_t * p;
+	
+	vol_ = dirFile->vol_;
+	dirFile->rewind();
+	
+	while (dirFile->curPosition_ < dirFile->fileSize_) {
+		uint8_t index = 0xF & (dirFile->curPosition_ >> 5);
+		
+		p = dirFile->readDirCache();
+		
+		if (!p)
+			return false;
+		
+		if (p->name[0] == DIR_NAME_FREE || p->name[0] == DIR_NAME_DELETED) {
+			if (!emptyFound) {
+				dirBlock_ = SdVolume::cacheBlockNumber_;
+				dirIndex_ = index;
+				emptyFound = true;
+			}
+			
+			if (p->name[0] == DIR_NAME_FREE)
+				break;
+		} else if (!memcmp(dname, p->name, 11)) {
+			if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL))
+				return false;
+			
+			return openCachedEntry(index, oflag);
+		}
+	}
+	
+	// only create the file with O_CREAT and O_WRITE
+	if ((oflag & (O_CREAT | O_WRITE)) != (O_CREAT | O_WRITE))
+		return false;
+	
+	if (emptyFound) {
+		p = cacheDirEntry(SdVolume::CACHE_FOR_WRITE);
+		
+		if (!p)
+			return false;
+	} else {
+		if (dirFile->type_ == FAT_FILE_TYPE_ROOT_FIXED || !dirFile->addDirCluster())
+			return false;
+		
+		dirBlock_ = SdVolume::cacheBlockNumber_;
+		dirIndex_ = 0;
+		p = SdVolume::cacheBuffer_.dir;
+	}
+	
+	memset(p, 0, sizeof(dir_t));
+	memcpy(p->name, dname, 11);
+	p->creationDate = p->lastAccessDate = p->lastWriteDate = SIM_DATE;
+	
+	if (!vol_->cacheFlush())
+		return false;
+	
+	return openCachedEntry(dirIndex_, oflag);
+}
+
+bool SdBaseFile::open(SdBaseFile * dirFile, uint16_t index, uint8_t oflag) {
+	if (!dirFile || isOpen())
+		return false;
+	
+	vol_ = dirFile->vol_;
+	
+	if (!dirFile->seekSet(32UL * index))
+		return false;
+	
+	dir_t * p = dirFile->readDirCache();
+	
+	if (!p || p->name[0] == DIR_NAME_FREE || p->name[0] == DIR_NAME_DELETED || p->name[0] == '.')
+		return false;
+	
+	return openCachedEntry(index & 0xF, oflag);
+}
+
+bool SdBaseFile::openCachedEntry(uint8_t dirIndex, uint8_t oflag) {
+	dir_t * p = &SdVolume::cacheBuffer_.dir[dirIndex];
+	
+	if ((p->attributes & (DIR_ATT_READ_ONLY | DIR_ATT_DIRECTORY)) && (oflag & (O_WRITE | O_TRUNC)))
+		return false;
+	
+	dirIndex_ = dirIndex;
+	dirBlock_ = SdVolume::cacheBlockNumber_;
+	firstCluster_ = ((uint32_t)p->firstClusterHigh << 16) | p->firstClusterLow;
+	
+	if (DIR_IS_FILE(p)) {
+		fileSize_ = p->fileSize;
+		type_ = FAT_FILE_TYPE_NORMAL;
+	} else if (DIR_IS_SUBDIR(p)) {
+		if (!vol_->chainSize(firstCluster_, &fileSize_))
+			return false;
+		
+		type_ = FAT_FILE_TYPE_SUBDIR;
+	} else
+		return false;
+	
+	flags_ = oflag & (O_ACCMODE | O_SYNC | O_APPEND);
+	curCluster_ = 0;
+	curPosition_ = 0;
+	
+	if ((oflag & O_TRUNC) && !truncate(0)) {
+		type_ = FAT_FILE_TYPE_CLOSED;
+		return false;
+	}
+	
+	return (oflag & O_AT_END) ? seekEnd(0) : true;
+}
+
+bool SdBaseFile::createContiguous(SdBaseFile * dirFile, const char * path, uint32_t size) {
+	if (!size || !open(dirFile, path, O_CREAT | O_EXCL | O_RDWR))
+		return false;
+	
+	uint32_t count = ((size - 1) >> (vol_->clusterSizeShift_ + 9)) + 1;
+	
+	if (!vol_->allocContiguous(count, &firstCluster_)) {
+		remove();
+		return false;
+	}
+	
+	fileSize_ = size;
+	flags_ |= F_FILE_DIR_DIRTY;
+	
+	return sync();
+}
+
+bool SdBaseFile::close() {
+	bool rtn = sync();
+	
+	type_ = FAT_FILE_TYPE_CLOSED;
+	
+	return rtn;
+}
+
+dir_t * SdBaseFile::cacheDirEntry(uint8_t action) {
+	cache_t * pc = vol_->cacheFetch(dirBlock_, action);
+	
+	return pc ? pc->dir + dirIndex_ : 0;
+}
+
+bool SdBaseFile::sync() {
+	if (!isOpen())
+		return false;
+	
+	if (flags_ & F_FILE_DIR_DIRTY) {
+		dir_t * d = cacheDirEntry(SdVolume::CACHE_FOR_WRITE);
+		
+		if (!d || d->name[0] == DIR_NAME_DELETED)
+			return false;
+		
+		if (!isDir())
+			d->fileSize = fileSize_;
+		
+		d->firstClusterLow = firstCluster_ & 0xFFFF;
+		d->firstClusterHigh = firstCluster_ >> 16;
+		d->lastWriteDate = d->lastAccessDate = SIM_DATE;
+		flags_ &= ~F_FILE_DIR_DIRTY;
+	}
+	
+	return vol_->cacheFlush();
+}
+
+bool SdBaseFile::truncate(uint32_t length) {
+	if (!isFile() || !(flags_ & O_WRITE) || length > fileSize_)
+		return false;
+	
+	if (!fileSize_)
+		return true;
+	
+	uint32_t newPos = curPosition_ > length ? length : curPosition_;
+	
+	if (!seekSet(length))
+		return false;
+	
+	if (!length) {
+		if (!vol_->freeChain(firstCluster_))
+			return false;
+		
+		firstCluster_ = 0;
+	} else {
+		uint32_t toFree;
+		
+		if (!vol_->fatGet(curCluster_, &toFree))
+			return false;
+		
+		if (!vol_->isEOC(toFree) && (!vol_->freeChain(toFree) || !vol_->fatPutEOC(curCluster_)))
+			return false;
+	}
+	
+	fileSize_ = length;
+	flags_ |= F_FILE_DIR_DIRTY;
+	
+	return sync() && seekSet(newPos);
+}
+
+bool SdBaseFile::remove() {
+	if (!truncate(0))
+		return false;
+	
+	dir_t * d = cacheDirEntry(SdVolume::CACHE_FOR_WRITE);
+	
+	if (!d)
+		return false;
+	
+	d->name[0] = DIR_NAME_DELETED;
+	type_ = FAT_FILE_TYPE_CLOSED;
+	
+	return vol_->cacheFlush();
+}
+
+int SdBaseFile::read() {
+	uint8_t b;
+	
+	return read(&b, 1) == 1 ? b : -1;
+}
+
+// whole blocks go straight to dst unless the block is in the cache
+int SdBaseFile::read(void * buf, size_t nbyte) {
+	uint8_t * dst = (uint8_t *)buf;
+	
+	if (!isOpen() || !(flags_ & O_READ))
+		return -1;
+	
+	if (nbyte > fileSize_ - curPosition_)
+		nbyte = fileSize_ - curPosition_;
+	
+	for (size_t toRead = nbyte; toRead;) {
+		uint16_t offset = curPosition_ & 0x1FF;
+		uint32_t block;
+		
+		if (type_ == FAT_FILE_TYPE_ROOT_FIXED)
+			block = vol_->rootDirStart() + (curPosition_ >> 9);
+		else {
+			uint8_t blockOfCluster = vol_->blockOfCluster(curPosition_);
+			
+			if (!offset && !blockOfCluster) {
+				if (!curPosition_)
+					curCluster_ = firstCluster_;
+				else if (!vol_->fatGet(curCluster_, &curCluster_))
+					return -1;
+			}
+			
+			block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
+		}
+		
+		uint16_t n = (toRead > 512U - offset) ? 512 - offset : toRead;
+		
+		if (n == 512 && block != SdVolume::cacheBlockNumber_) {
+			if (!vol_->sdCard()->readBlock(block, dst))
+				return -1;
+		} else {
+			cache_t * pc = vol_->cacheFetch(block, SdVolume::CACHE_FOR_READ);
+			
+			if (!pc)
+				return -1;
+			
+			memcpy(dst, pc->data + offset, n);
+		}
+		
+		dst += n;
+		curPosition_ += n;
+		toRead -= n;
+	}
+	
+	return nbyte;
+}
+
+dir_t * SdBaseFile::readDirCache() {
+	if (!isDir())
+		return 0;
+	
+	uint8_t i = (curPosition_ >> 5) & 0xF;
+	
+	if (read() < 0)
+		return 0;
+	
+	curPosition_ += 31;
+	
+	return SdVolume::cacheBuffer_.dir + i;
+}
+
+int8_t SdBaseFile::readDir(dir_t * dir) {
+	if (!isDir() || (curPosition_ & 0x1F))
+		return -1;
+	
+	for (;;) {
+		int n = read(dir, sizeof(dir_t));
+		
+		if (n != sizeof(dir_t))
+			return n ? -1 : 0;
+		
+		if (dir->name[0] == DIR_NAME_FREE)
+			return 0;
+		
+		if (dir->name[0] == DIR_NAME_DELETED || dir->name[0] == '.')
+			continue;
+		
+		if (DIR_IS_FILE_OR_SUBDIR(dir))
+			return n;
+	}
+}
+
+bool SdBaseFile::addCluster() {
+	if (!vol_->allocContiguous(1, &curCluster_))
+		return false;
+	
+	if (!firstCluster_) {
+		firstCluster_ = curCluster_;
+		flags_ |= F_FILE_DIR_DIRTY;
+	}
+	
+	return true;
+}
+
+// a new, zeroed cluster at the end of a directory. its first block is left
+// in the cache
+bool SdBaseFile::addDirCluster() {
+	if (fileSize_ / sizeof(dir_t) >= 0xFFFF)
+		return false;
+	
+	seekSet(fileSize_);
+	
+	if (!addCluster() || !vol_->cacheFlush())
+		return false;
+	
+	uint32_t block = vol_->clusterStartBlock(curCluster_);
+	
+	memset(SdVolume::cacheBuffer_.data, 0, 512);
+	
+	for (uint8_t i = 1; i < vol_->blocksPerCluster_; i++)
+		if (!vol_->sdCard()->writeBlock(block + i, SdVolume::cacheBuffer_.data))
+			return false;
+	
+	SdVolume::cacheBlockNumber_ = block;
+	SdVolume::cacheDirty_ = true;
+	fileSize_ += 512UL << vol_->clusterSizeShift_;
+	
+	return true;
+}
+
+int SdBaseFile::write(const void * buf, size_t nbyte) {
+	const uint8_t * src = (const uint8_t *)buf;
+	
+	if (!isFile() || !(flags_ & O_WRITE))
+		return -1;
+	
+	if ((flags_ & O_APPEND) && curPosition_ != fileSize_ && !seekEnd())
+		return -1;
+	
+	for (size_t toWrite = nbyte; toWrite;) {
+		uint8_t blockOfCluster = vol_->blockOfCluster(curPosition_);
+		uint16_t offset = curPosition_ & 0x1FF;
+		
+		if (!blockOfCluster && !offset) { // start of a cluster
+			if (!curCluster_) {
+				if (!firstCluster_) {
+					if (!addCluster())
+						return -1;
+				} else
+					curCluster_ = firstCluster_;
+			} else {
+				uint32_t next;
+				
+				if (!vol_->fatGet(curCluster_, &next))
+					return -1;
+				
+				if (vol_->isEOC(next)) {
+					if (!addCluster())
+						return -1;
+				} else
+					curCluster_ = next;
+			}
+		}
+		
+		uint16_t n = (toWrite > 512U - offset) ? 512 - offset : toWrite;
+		uint32_t block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
+		
+		if (n == 512) {
+			if (SdVolume::cacheBlockNumber_ == block) { // it is all replaced
+				SdVolume::cacheBlockNumber_ = 0xFFFFFFFF;
+				SdVolume::cacheDirty_ = false;
+			}
+			
+			if (!vol_->sdCard()->writeBlock(block, src))
+				return -1;
+		} else {
+			// a new block past the end of the file need not be read first
+			uint8_t options = (!offset && curPosition_ >= fileSize_) ? SdVolume::CACHE_RESERVE_FOR_WRITE : SdVolume::CACHE_FOR_WRITE;
+			cache_t * pc = vol_->cacheFetch(block, options);
+			
+			if (!pc)
+				return -1;
+			
+			memcpy(pc->data + offset, src, n);
+		}
+		
+		curPosition_ += n;
+		src += n;
+		toWrite -= n;
+	}
+	
+	if (curPosition_ > fileSize_) {
+		fileSize_ = curPosition_;
+		flags_ |= F_FILE_DIR_DIRTY;
+	}
+	
+	if ((flags_ & O_SYNC) && !sync())
+		return -1;
+	
+	return nbyte;
+}
+
+bool SdBaseFile::seekSet(uint32_t pos) {
+	if (!isOpen() || pos > fileSize_)
+		return false;
+	
+	if (type_ == FAT_FILE_TYPE_ROOT_FIXED) {
+		curPosition_ = pos;
+		return true;
+	}
+	
+	if (!pos) {
+		curCluster_ = 0;
+		curPosition_ = 0;
+		return true;
+	}
+	
+	// cluster index of the byte before the current and the new position
+	uint8_t shift = vol_->clusterSizeShift_ + 9;
+	uint32_t nCur = (curPosition_ - 1) >> shift;
+	uint32_t nNew = (pos - 1) >> shift;
+	
+	if (nNew < nCur || !curPosition_)
+		curCluster_ = firstCluster_;
+	else
+		nNew -= nCur;
+	
+	while (nNew--)
+		if (!vol_->fatGet(curCluster_, &curCluster_))
+			return false;
+	
+	curPosition_ = pos;
+	
+	return true;
+}
+
+bool SdBaseFile::contiguousRange(uint32_t * bgnBlock, uint32_t * endBlock) {
+	if (!firstCluster_)
+		return false;
+	
+	for (uint32_t c = firstCluster_;; c++) {
+		uint32_t next;
+		
+		if (!vol_->fatGet(c, &next))
+			return false;
+		
+		if (next != c + 1) {
+			if (!vol_->isEOC(next))
+				return false;
+			
+			*bgnBlock = vol_->clusterStartBlock(firstCluster_);
+			*endBlock = vol_->clusterStartBlock(c) + vol_->blocksPerCluster_ - 1;
+			
+			return true;
+		}
+	}
+}
+
+bool SdBaseFile::dirEntry(dir_t * dir) {
+	dir_t * p = cacheDirEntry(SdVolume::CACHE_FOR_READ);
+	
+	if (!p)
+		return false;
+	
+	memcpy(dir, p, sizeof(dir_t));
+	
+	return true;
+}
+
+bool SdBaseFile::getFilename(char * name) {
+	dir_t d;
+	
+	if (!isOpen())
+		return false;
+	
+	if (isRoot()) {
+		strcpy(name, "/");
+		return true;
+	}
+	
+	if (!dirEntry(&d))
+		return false;
+	
+	for (uint8_t i = 0; i < 11; i++) {
+		if (d.name[i] == ' ')
+			continue;
+		
+		if (i == 8)
+			*name++ = '.';
+		
+		*name++ = d.name[i];
+	}
+	
+	*name = 0;
+	
+	return true;
+}
+
+//////////////////////////////////////////////////////////////
+// SdFat
+
+bool SdFat::begin(uint8_t, uint8_t sckRateID) {
+	return card_.init(sckRateID) && vol_.init(&card_) && chdir(true);
+}
+
+bool SdFat::chdir(bool set_cwd) {
+	if (set_cwd)
+		SdBaseFile::cwd_ = &vwd_;
+	
+	vwd_.close();
+	
+	return vwd_.openRoot(&vol_);
+}
+
+bool SdFat::chdir(const char * path, bool set_cwd) {
+	SdBaseFile dir;
+	
+	if (path[0] == '/' && path[1] == '\0')
+		return chdir(set_cwd);
+	
+	if (!dir.open(&vwd_, path, O_READ) || !dir.isDir())
+		return false;
+	
+	vwd_ = dir;
+	
+	if (set_cwd)
+		SdBaseFile::cwd_ = &vwd_;
+	
+	return true;
+}
+
+bool SdFat::exists(const char * name) {
+	SdBaseFile file;
+	
+	return file.open(&vwd_, name, O_READ);
+}
+
+bool SdFat::remove(const char * path) {
+	SdBaseFile file;
+	
+	return file.open(&vwd_, path, O_WRITE) && file.remove();
+}
@@ -0,0 +1,113 @@
+#include <chrono>
+#include <thread>
+
+#include <avr/interrupt.h>
+#include <zzjduino.h>
+
+#include "SimBus.h"
+
+SimBus simBus;
+SimSerial Serial;
+
+SimBus::SimBus() : err(false), led(false), cardIn(true), overflows(0),
+		q_(true), reg_(0), head_(0), count_(0) {
+}
+
+bool SimBus::q() {
+	std::lock_guard<std::mutex> hold(lock_);
+	return q_;
+}
+
+uint8_t SimBus::reg() {
+	std::lock_guard<std::mutex> hold(lock_);
+	return reg_;
+}
+
+void SimBus::ffReset() {
+	std::lock_guard<std::mutex> hold(lock_);
+	q_ = false;
+	changed_.notify_all();
+}
+
+// timed waits stand in for idle mode, where the millis tick ends the sleep
+bool SimBus::waitQ(bool timed) {
+	std::unique_lock<std::mutex> hold(lock_);
+	
+	if (q_)
+		return false;
+	
+	if (timed)
+		changed_.wait_for(hold, std::chrono::milliseconds(1), [this] { return q_; });
+	else
+		changed_.wait(hold, [this] { return q_; });
+	
+	return true;
+}
+
+void SimBus::put(uint8_t b) {
+	std::lock_guard<std::mutex> hold(lock_);
+	
+	if (count_ == SIM_FIFO_SIZE) {
+		overflows++;
+		return;
+	}
+	
+	fifo_[(head_ + count_++) % SIM_FIFO_SIZE] = b;
+}
+
+bool SimBus::get(uint8_t * b) {
+	std::lock_guard<std::mutex> hold(lock_);
+	
+	if (!count_)
+		return false;
+	
+	*b = fifo_[head_];
+	head_ = (head_ + 1) % SIM_FIFO_SIZE;
+	count_--;
+	
+	return true;
+}
+
+uint16_t SimBus::count() {
+	std::lock_guard<std::mutex> hold(lock_);
+	return count_;
+}
+
+void SimBus::reset() {
+	std::lock_guard<std::mutex> hold(lock_);
+	head_ = count_ = 0;
+}
+
+void SimBus::command(uint8_t inst) {
+	INT0_vect(); // Q's rising edge
+	
+	std::lock_guard<std::mutex> hold(lock_);
+	reg_ = inst;
+	q_ = true;
+	changed_.notify_all();
+}
+
+void SimBus::waitIdle() {
+	std::unique_lock<std::mutex> hold(lock_);
+	changed_.wait(hold, [this] { return !q_; });
+}
+
+//////////////////////////////////////////////////////////////
+// zzjduino time keeping
+
+static std::chrono::steady_clock::time_point bootTime = std::chrono::steady_clock::now();
+
+void millis_start() {
+}
+
+uint32_t millis() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+uint32_t micros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+void delay(uint32_t ms) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
@@ -0,0 +1,52 @@
+// the parts of the board between the AVR and the host: the '373 that holds
+// the instruction byte, the Q flip-flop, the 512 byte fifo and the status
+// lines. sim/SDCardHAL.h is the AVR's side of it, bench.cpp the host's
+#ifndef SIM_BUS_H
+#define SIM_BUS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#define SIM_FIFO_SIZE 512
+
+class SimBus {
+public:
+	SimBus();
+	
+	// AVR side
+	bool q();
+	uint8_t reg();
+	void ffReset();
+	bool waitQ(bool timed);	// false if Q was already high
+	
+	// either side; the AVR and the host never use the fifo at the same time
+	void put(uint8_t b);
+	bool get(uint8_t * b);
+	uint16_t count();
+	void reset();
+	
+	// host side
+	void command(uint8_t inst);	// latch the instruction and raise Q
+	void waitIdle();			// until busy (Q) is low
+	
+	std::atomic<bool> err;
+	std::atomic<bool> led;
+	std::atomic<bool> cardIn;
+	std::atomic<uint32_t> overflows;	// bytes written to a full fifo, lost
+	
+private:
+	std::mutex lock_;
+	std::condition_variable changed_;
+	
+	bool q_;
+	uint8_t reg_;
+	uint8_t fifo_[SIM_FIFO_SIZE];
+	uint16_t head_;
+	uint16_t count_;
+};
+
+extern SimBus simBus;
+
+#endif
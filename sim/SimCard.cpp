@@ -0,0 +1,139 @@
+// the image file behind the simulated card, and its timing
+
+#include <chrono>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SimCard.h"
+
+SimCardCounts simCardCounts;
+SimCardTiming simCardTiming = { 250, 410, 800, 120 };
+
+static int image = -1;
+static uint32_t imageBlocks;
+
+void sim_spin(uint32_t us) {
+	if (!us)
+		return;
+	
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+	
+	while (std::chrono::steady_clock::now() < end) ;
+}
+
+bool sim_card_read(uint32_t block, uint8_t * dst) {
+	return block < imageBlocks && pread(image, dst, 512, (off_t)block << 9) == 512;
+}
+
+bool sim_card_write(uint32_t block, const uint8_t * src) {
+	return block < imageBlocks && pwrite(image, src, 512, (off_t)block << 9) == 512;
+}
+
+static void put16(uint8_t * p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t * p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+// FAT16 without a partition table, 2 FATs and 512 root entries
+static bool image_format() {
+	uint8_t block[512];
+	uint8_t perCluster = 1;
+	
+	while (imageBlocks / perCluster > 65000 && perCluster < 64)
+		perCluster <<= 1;
+	
+	uint32_t fatBlocks = 1;
+	
+	// the FAT has to cover the clusters left after it
+	for (;;) {
+		uint32_t clusters = (imageBlocks - 1 - 2 * fatBlocks - 32) / perCluster;
+		
+		if ((clusters + 2) * 2 <= fatBlocks * 512)
+			break;
+		
+		fatBlocks++;
+	}
+	
+	uint32_t clusters = (imageBlocks - 1 - 2 * fatBlocks - 32) / perCluster;
+	
+	if (clusters < 4085 || clusters >= 65525)
+		return false;
+	
+	memset(block, 0, sizeof(block));
+	block[0] = 0xEB;
+	block[1] = 0x3C;
+	block[2] = 0x90;
+	memcpy(block + 3, "SDSIM   ", 8);
+	put16(block + 11, 512);
+	block[13] = perCluster;
+	put16(block + 14, 1);
+	block[16] = 2;
+	put16(block + 17, 512);
+	put16(block + 19, imageBlocks < 65536 ? imageBlocks : 0);
+	block[21] = 0xF8;
+	put16(block + 22, fatBlocks);
+	put16(block + 24, 32);
+	put16(block + 26, 64);
+	put32(block + 32, imageBlocks < 65536 ? 0 : imageBlocks);
+	block[36] = 0x80;
+	block[38] = 0x29;
+	put32(block + 39, 0x5D5D1234);
+	memcpy(block + 43, "SDSIM      FAT16   ", 19);
+	block[510] = 0x55;
+	block[511] = 0xAA;
+	
+	if (!sim_card_write(0, block))
+		return false;
+	
+	memset(block, 0, sizeof(block));
+	
+	for (uint32_t b = 1; b < 1 + 2 * fatBlocks + 32; b++)
+		if (!sim_card_write(b, block))
+			return false;
+	
+	put16(block, 0xFFF8);
+	put16(block + 2, 0xFFFF);
+	
+	return sim_card_write(1, block) && sim_card_write(1 + fatBlocks, block);
+}
+
+bool sim_card_open(const char * path, uint32_t sizeMB) {
+	struct stat st;
+	bool fresh = stat(path, &st) != 0;
+	
+	image = open(path, O_RDWR | O_CREAT, 0644);
+	
+	if (image < 0)
+		return false;
+	
+	if (fresh) {
+		imageBlocks = sizeMB << 11;
+		
+		if (ftruncate(image, (off_t)imageBlocks << 9) || !image_format()) {
+			sim_card_close();
+			unlink(path);
+			return false;
+		}
+	} else
+		imageBlocks = st.st_size >> 9;
+	
+	return true;
+}
+
+uint32_t sim_card_blocks() {
+	return (image >= 0) ? imageBlocks : 0;
+}
+
+void sim_card_close() {
+	if (image >= 0)
+		close(image);
+	
+	image = -1;
+}
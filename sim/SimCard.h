@@ -0,0 +1,44 @@
+// the simulated card behind Sd2Card: an image file, counters for the SD
+// commands the firmware sends, and a timing model so that transfers cost
+// roughly what they do on a card clocked at F_CPU / 2
+#ifndef SIM_CARD_H
+#define SIM_CARD_H
+
+#include <stdint.h>
+
+struct SimCardCounts {
+	uint32_t cmd17;			// single block reads
+	uint32_t cmd18;			// multi-block reads started
+	uint32_t cmd24;			// single block writes
+	uint32_t cmd25;			// multi-block writes started
+	uint32_t cmd12;			// multi-block reads stopped
+	uint32_t blocksRead;
+	uint32_t blocksWritten;
+	uint32_t erased;		// pre-erased blocks a multi-block write stopped short of
+	uint32_t violations;	// commands sent while a transfer was open, or data with none
+};
+
+// microseconds each part of a transfer takes, all 0 runs as fast as the host can
+struct SimCardTiming {
+	uint16_t access;		// command to the first data token of a read
+	uint16_t block;			// clocking 512 bytes and the CRC over SPI
+	uint16_t program;		// busy after a single block write, or the end of a multi-block one
+	uint16_t programMulti;	// busy after each block of a multi-block write
+};
+
+extern SimCardCounts simCardCounts;
+extern SimCardTiming simCardTiming;
+
+// opens the image, creating and formatting it FAT16 with sizeMB if missing
+bool sim_card_open(const char * path, uint32_t sizeMB);
+void sim_card_close();
+uint32_t sim_card_blocks();	// 0 if no image is open
+
+// one block of the image, false past its end
+bool sim_card_read(uint32_t block, uint8_t * dst);
+bool sim_card_write(uint32_t block, const uint8_t * src);
+
+// busy-waits, sleeping is too coarse for these times
+void sim_spin(uint32_t us);
+
+#endif
@@ -0,0 +1,514 @@
+// benchmark driver for the Linux build: runs the firmware in a thread, plays
+// the host's side of the bus and times whole instructions the way the host
+// sees them - from writing the instruction to busy going low.
+//
+// usage: sdbench [-i image] [-s MB] [-k KB] [-f files] [-o options] [-z] [scenario...]
+//   -i image	 card image, created and formatted FAT16 if missing (sdbench.img)
+//   -s MB		 size of a new image (64)
+//   -k KB		 file size for the read, write and md5 scenarios (1024)
+//   -f files	 number of files for the dir scenario (100)
+//   -o options	 OPTIONS bits to run with (the firmware's default)
+//   -z			 no card timing, transfers cost only the host's time
+// scenarios: write read stream wstream md5 dir, all of them by default.
+// read, stream and md5 check the file write made, at the same -k.
+// exits 1 if any data, digest or reply was wrong or the card was misused.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+
+#include <avr/interrupt.h>
+#include <zzjduino.h>
+#include <md5.h>
+
+#include <SdFat.h>
+
+#include "../SDCard.h"
+#include "SimBus.h"
+#include "SimCard.h"
+
+int firmware_main();
+
+struct Reply {
+	bool err;
+	uint16_t len;
+	uint8_t data[SIM_FIFO_SIZE];
+};
+
+// per scenario
+struct Tally {
+	uint32_t commands;
+	uint32_t minUs;
+	uint32_t maxUs;
+	uint64_t totalUs;
+};
+
+static Tally tally;
+static uint32_t failures = 0;
+static uint32_t fileBytes = 1024UL * 1024;
+static uint16_t fileCount = 100;
+static bool streamWritten = false;	// STREAM.DAT is from this run
+static bool crc = false;			// OPT_CRC is on
+
+static void fail(const char * what) {
+	fprintf(stderr, "FAIL: %s\n", what);
+	failures++;
+}
+
+static void write_args(const void * args, uint16_t len) {
+	const uint8_t * p = (const uint8_t *)args;
+	
+	while (len--)
+		simBus.put(*p++);
+}
+
+static void drain(Reply * r) {
+	r->err = simBus.err;
+	r->len = 0;
+	
+	while (r->len < SIM_FIFO_SIZE && simBus.get(r->data + r->len))
+		r->len++;
+}
+
+// raise Q with the instruction latched and wait for busy to drop
+static void strobe(uint8_t inst) {
+	uint32_t t = micros();
+	
+	simBus.command(inst);
+	simBus.waitIdle();
+	
+	t = micros() - t;
+	
+	if (!tally.commands++ || t < tally.minUs)
+		tally.minUs = t;
+	
+	if (t > tally.maxUs)
+		tally.maxUs = t;
+	
+	tally.totalUs += t;
+}
+
+static bool run(uint8_t inst, const void * args, uint16_t len, Reply * r) {
+	write_args(args, len);
+	strobe(inst);
+	drain(r);
+	
+	return !r->err;
+}
+
+static uint16_t get16(const uint8_t * p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t * p) {
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint16_t crc16(const uint8_t * p, uint16_t count) {
+	uint16_t crc = 0;
+	
+	while (count--) {
+		crc ^= *p++;
+		
+		for (uint8_t i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	
+	return crc;
+}
+
+// the test data, different in every block
+static uint8_t pattern(uint32_t pos) {
+	return pos * 7 + (pos >> 9) * 13;
+}
+
+static bool open_file(const char * name, uint8_t mode) {
+	uint8_t args[16];
+	Reply r;
+	
+	args[0] = mode;
+	strcpy((char *)args + 1, name);
+	
+	return run(OPEN, args, strlen(name) + 2, &r);
+}
+
+static bool close_file() {
+	Reply r;
+	
+	return run(CLOSE, 0, 0, &r);
+}
+
+//////////////////////////////////////////////////////////////
+// scenarios, each returns the number of data bytes moved
+
+static uint32_t bench_write() {
+	uint8_t chunk[BUFFER_SIZE];
+	Reply r;
+	
+	if (!open_file("BENCH.DAT", OPEN_TRUNC)) {
+		fail("write: OPEN");
+		return 0;
+	}
+	
+	// with OPT_CRC the last 2 bytes of each WRITE are the CRC
+	uint16_t step = crc ? BUFFER_SIZE - 2 : BUFFER_SIZE;
+	
+	for (uint32_t pos = 0; pos < fileBytes; pos += step) {
+		uint16_t n = (fileBytes - pos < step) ? fileBytes - pos : step;
+		
+		for (uint16_t i = 0; i < n; i++)
+			chunk[i] = pattern(pos + i);
+		
+		if (crc) {
+			uint16_t c = crc16(chunk, n);
+			
+			chunk[n] = c;
+			chunk[n + 1] = c >> 8;
+		}
+		
+		if (!run(WRITE, chunk, n + (crc ? 2 : 0), &r) || r.len != 2 || get16(r.data) != n) {
+			fail("write: WRITE");
+			break;
+		}
+	}
+	
+	if (!close_file())
+		fail("write: CLOSE");
+	
+	return fileBytes;
+}
+
+static uint32_t bench_read() {
+	uint32_t pos = 0;
+	Reply r;
+	
+	if (!open_file("BENCH.DAT", OPEN_READ)) {
+		fail("read: OPEN");
+		return 0;
+	}
+	
+	for (;;) {
+		if (!run(READ, 0, 0, &r) || r.len < (crc ? 4 : 2) || get16(r.data) != r.len - (crc ? 4 : 2)) {
+			fail("read: READ");
+			break;
+		}
+		
+		uint16_t n = get16(r.data);
+		
+		if (crc && get16(r.data + 2 + n) != crc16(r.data + 2, n))
+			fail("read: CRC differs");
+		
+		if (!n)
+			break;
+		
+		for (uint16_t i = 2; i < 2 + n; i++, pos++)
+			if (r.data[i] != pattern(pos)) {
+				fail("read: data differs");
+				close_file();
+				return pos;
+			}
+	}
+	
+	if (pos != fileBytes)
+		fail("read: short file");
+	
+	close_file();
+	
+	return pos;
+}
+
+static uint32_t bench_stream() {
+	uint32_t want = 0xFFFFFFFF;
+	uint32_t pos = 0;
+	uint8_t trailer[5];
+	uint8_t got = 0;
+	Reply r;
+	
+	if (!open_file("BENCH.DAT", OPEN_READ)) {
+		fail("stream: OPEN");
+		return 0;
+	}
+	
+	write_args(&want, 4);
+	strobe(READ_STREAM);
+	
+	// data, then the 5 byte trailer; the host asks for more while it is short
+	for (;;) {
+		drain(&r);
+		
+		if (r.err) {
+			fail("stream: READ_STREAM");
+			break;
+		}
+		
+		for (uint16_t i = 0; i < r.len; i++) {
+			if (pos < fileBytes) {
+				if (r.data[i] != pattern(pos))
+					fail("stream: data differs");
+				
+				pos++;
+			} else if (got < sizeof(trailer))
+				trailer[got++] = r.data[i];
+		}
+		
+		if (got == sizeof(trailer) || !r.len)
+			break;
+		
+		strobe(READ_STREAM);
+	}
+	
+	if (got != sizeof(trailer) || trailer[0] || get32(trailer + 1) != fileBytes)
+		fail("stream: trailer");
+	
+	close_file();
+	
+	return pos;
+}
+
+static uint32_t bench_wstream() {
+	uint8_t chunk[BUFFER_SIZE];
+	Reply r;
+	
+	if (!open_file("STREAM.DAT", OPEN_TRUNC)) {
+		fail("wstream: OPEN");
+		return 0;
+	}
+	
+	write_args(&fileBytes, 4);
+	strobe(WRITE_STREAM);
+	
+	for (uint32_t pos = 0; pos < fileBytes; pos += BUFFER_SIZE) {
+		uint16_t n = (fileBytes - pos < BUFFER_SIZE) ? fileBytes - pos : BUFFER_SIZE;
+		
+		for (uint16_t i = 0; i < n; i++)
+			chunk[i] = pattern(pos + i);
+		
+		write_args(chunk, n);
+		strobe(WRITE_STREAM);
+	}
+	
+	drain(&r);
+	
+	if (r.err || r.len != 5 || r.data[0] || get32(r.data + 1) != fileBytes)
+		fail("wstream: WRITE_STREAM");
+	
+	if (!close_file())
+		fail("wstream: CLOSE");
+	
+	streamWritten = true;
+	
+	return fileBytes;
+}
+
+// the digest of the written files, worked out by the firmware and here
+static uint32_t bench_md5() {
+	md5_state_t state;
+	uint8_t chunk[BUFFER_SIZE];
+	uint8_t digest[16];
+	const char * names[] = { "BENCH.DAT", "STREAM.DAT" };
+	uint32_t total = 0;
+	Reply r;
+	
+	md5_init(&state);
+	
+	for (uint32_t pos = 0; pos < fileBytes; pos += BUFFER_SIZE) {
+		uint16_t n = (fileBytes - pos < BUFFER_SIZE) ? fileBytes - pos : BUFFER_SIZE;
+		
+		for (uint16_t i = 0; i < n; i++)
+			chunk[i] = pattern(pos + i);
+		
+		md5_append(&state, chunk, n);
+	}
+	
+	md5_finish(&state, digest);
+	
+	for (uint8_t i = 0; i < (streamWritten ? 2 : 1); i++) {
+		if (!run(FILE_MD5, names[i], strlen(names[i]) + 1, &r)) {
+			fail("md5: FILE_MD5");
+			continue;
+		}
+		
+		if (r.len != 20 || get32(r.data) != fileBytes || memcmp(r.data + 4, digest, 16))
+			fail("md5: digest differs");
+		
+		total += fileBytes;
+	}
+	
+	return total;
+}
+
+// creating files, listing them and looking them up by name
+static uint32_t bench_dir() {
+	char name[13];
+	uint16_t listed = 0;
+	uint8_t page = 0;
+	Reply r;
+	
+	for (uint16_t i = 0; i < fileCount; i++) {
+		sprintf(name, "F%04u.TXT", i);
+		
+		if (!open_file(name, OPEN_WRITE) || !run(WRITE, name, 9, &r) || !close_file()) {
+			fail("dir: creating files");
+			return 0;
+		}
+	}
+	
+	for (bool first = true;; first = false) {
+		if (!run(DIR, &page, first ? 0 : 1, &r) || !r.len) {
+			fail("dir: DIR");
+			break;
+		}
+		
+		page = r.data[0];
+		
+		uint16_t i = 1;
+		
+		for (; i + 15 <= r.len; i += 15)
+			listed++;
+		
+		if (i < r.len && r.data[i] == DIR_NO_MORE_FILES)
+			break;
+	}
+	
+	if (listed < fileCount)
+		fail("dir: files missing from the listing");
+	
+	for (uint16_t i = 0; i < fileCount; i++) {
+		sprintf(name, "F%04u.TXT", (i * 37) % fileCount);
+		
+		if (!run(EXISTS, name, 10, &r))
+			fail("dir: EXISTS");
+	}
+	
+	if (run(EXISTS, "NOSUCH.TXT", 11, &r))
+		fail("dir: EXISTS of a missing file");
+	
+	return 0;
+}
+
+static const struct {
+	const char * name;
+	uint32_t (*run)();
+} scenarios[] = {
+	{ "write", bench_write },
+	{ "read", bench_read },
+	{ "stream", bench_stream },
+	{ "wstream", bench_wstream },
+	{ "md5", bench_md5 },
+	{ "dir", bench_dir },
+};
+
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+// card commands are counted from the start of the scenario
+static void report(const char * name, uint32_t bytes, uint32_t us, const SimCardCounts & before) {
+	SimCardCounts c = simCardCounts;
+	
+	c.cmd17 -= before.cmd17;
+	c.cmd18 -= before.cmd18;
+	c.cmd24 -= before.cmd24;
+	c.cmd25 -= before.cmd25;
+	c.cmd12 -= before.cmd12;
+	c.blocksRead -= before.blocksRead;
+	c.blocksWritten -= before.blocksWritten;
+	
+	printf("%-8s %8u B %9.1f ms", name, bytes, us / 1000.0);
+	
+	if (bytes)
+		printf(" %8.1f KB/s", bytes / 1.024 / us * 1000);
+	else
+		printf(" %13s", "");
+	
+	printf("  %6u cmds  us min/avg/max %u/%u/%u", tally.commands, tally.minUs,
+		tally.commands ? (uint32_t)(tally.totalUs / tally.commands) : 0, tally.maxUs);
+	printf("  CMD17 %u CMD18 %u CMD24 %u CMD25 %u CMD12 %u  blocks r/w %u/%u\n",
+		c.cmd17, c.cmd18, c.cmd24, c.cmd25, c.cmd12, c.blocksRead, c.blocksWritten);
+}
+
+int main(int argc, char ** argv) {
+	const char * imageName = "sdbench.img";
+	uint32_t sizeMB = 64;
+	int options = -1;
+	int opt;
+	
+	while ((opt = getopt(argc, argv, "i:s:k:f:o:z")) != -1) {
+		switch (opt) {
+			case 'i': imageName = optarg; break;
+			case 's': sizeMB = atoi(optarg); break;
+			case 'k': fileBytes = atol(optarg) * 1024; break;
+			case 'f': fileCount = atoi(optarg); break;
+			case 'o': options = strtol(optarg, 0, 0); break;
+			case 'z': memset(&simCardTiming, 0, sizeof(simCardTiming)); break;
+			default:
+				fprintf(stderr, "usage: %s [-i image] [-s MB] [-k KB] [-f files] [-o options] [-z] [scenario...]\n", argv[0]);
+				return 2;
+		}
+	}
+	
+	if (!sim_card_open(imageName, sizeMB)) {
+		fprintf(stderr, "cannot open or create %s\n", imageName);
+		return 2;
+	}
+	
+	std::thread(firmware_main).detach();
+	simBus.waitIdle();
+	
+	if (simBus.err) {
+		fprintf(stderr, "card initialisation failed\n");
+		return 2;
+	}
+	
+	Reply r;
+	
+	if (options >= 0) {
+		uint8_t o = options;
+		
+		if (!run(OPTIONS, &o, 1, &r) || r.len != 1 || r.data[0] != o) {
+			fprintf(stderr, "OPTIONS 0x%02X not accepted\n", o);
+			return 2;
+		}
+	}
+	
+	run(OPTIONS, 0, 0, &r);
+	crc = r.data[0] & OPT_CRC;
+	printf("options 0x%02X, %u byte files, card timing %s\n", r.data[0], fileBytes,
+		simCardTiming.block ? "on" : "off");
+	
+	for (uint8_t i = 0; i < SCENARIOS; i++) {
+		bool wanted = (optind == argc);
+		
+		for (int a = optind; a < argc; a++)
+			wanted |= !strcmp(argv[a], scenarios[i].name);
+		
+		if (!wanted)
+			continue;
+		
+		SimCardCounts before = simCardCounts;
+		
+		memset(&tally, 0, sizeof(tally));
+		
+		uint32_t start = micros();
+		uint32_t bytes = scenarios[i].run();
+		
+		report(scenarios[i].name, bytes, micros() - start, before);
+	}
+	
+	if (simCardCounts.violations)
+		fail("card commands sent in the middle of a multi-block transfer");
+	
+	if (simCardCounts.erased)
+		fprintf(stderr, "note: %u pre-erased blocks were left unwritten\n", simCardCounts.erased);
+	
+	if (simBus.overflows)
+		fail("fifo overflowed");
+	
+	sim_card_close();
+	
+	printf("%s\n", failures ? "FAILED" : "ok");
+	fflush(stdout);
+	
+	// the firmware thread never returns, don't destroy the bus under it
+	_exit(failures ? 1 : 0);
+}
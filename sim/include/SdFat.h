@@ -0,0 +1,296 @@
+// sim stand-in for SDFatLib2: the same classes and the members SDCard.cpp
+// uses, over a FAT16/FAT32 image file instead of a card on the SPI bus.
+// short (8.3) names only, like the library the firmware is built with.
+// Sd2Card counts the SD commands it is sent, see sim/SimCard.h
+#ifndef SIM_SDFAT_H
+#define SIM_SDFAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// open flags, same values as SdFat
+#define O_READ		0x01
+#define O_RDONLY	O_READ
+#define O_WRITE		0x02
+#define O_WRONLY	O_WRITE
+#define O_RDWR		(O_READ | O_WRITE)
+#define O_ACCMODE	(O_READ | O_WRITE)
+#define O_APPEND	0x04
+#define O_SYNC		0x08
+#define O_TRUNC		0x10
+#define O_AT_END	0x20
+#define O_CREAT		0x40
+#define O_EXCL		0x80
+
+uint8_t const SPI_FULL_SPEED = 0;
+uint8_t const SPI_HALF_SPEED = 1;
+uint8_t const SPI_QUARTER_SPEED = 2;
+
+uint16_t const SD_READ_TIMEOUT = 300;
+uint8_t const DATA_START_BLOCK = 0xFE;
+
+// card error codes the sim reports
+uint8_t const SD_CARD_ERROR_CMD12 = 0x02;
+uint8_t const SD_CARD_ERROR_CMD17 = 0x04;
+uint8_t const SD_CARD_ERROR_CMD18 = 0x05;
+uint8_t const SD_CARD_ERROR_CMD24 = 0x06;
+uint8_t const SD_CARD_ERROR_CMD25 = 0x07;
+uint8_t const SD_CARD_ERROR_ACMD23 = 0x0C;
+uint8_t const SD_CARD_ERROR_READ = 0x11;
+uint8_t const SD_CARD_ERROR_STOP_TRAN = 0x16;
+uint8_t const SD_CARD_ERROR_WRITE = 0x18;
+uint8_t const SD_CARD_ERROR_WRITE_MULTIPLE = 0x1A;
+uint8_t const SD_CARD_ERROR_BUSY = 0x20;	// sim only: command while a transfer is open
+
+// directory entry
+struct dir_t {
+	uint8_t name[11];
+	uint8_t attributes;
+	uint8_t reservedNT;
+	uint8_t creationTimeTenths;
+	uint16_t creationTime;
+	uint16_t creationDate;
+	uint16_t lastAccessDate;
+	uint16_t firstClusterHigh;
+	uint16_t lastWriteTime;
+	uint16_t lastWriteDate;
+	uint16_t firstClusterLow;
+	uint32_t fileSize;
+} __attribute__((packed));
+
+uint8_t const DIR_NAME_0XE5 = 0x05;
+uint8_t const DIR_NAME_DELETED = 0xE5;
+uint8_t const DIR_NAME_FREE = 0x00;
+uint8_t const DIR_ATT_READ_ONLY = 0x01;
+uint8_t const DIR_ATT_HIDDEN = 0x02;
+uint8_t const DIR_ATT_SYSTEM = 0x04;
+uint8_t const DIR_ATT_VOLUME_ID = 0x08;
+uint8_t const DIR_ATT_DIRECTORY = 0x10;
+uint8_t const DIR_ATT_ARCHIVE = 0x20;
+uint8_t const DIR_ATT_LONG_NAME = 0x0F;
+uint8_t const DIR_ATT_LONG_NAME_MASK = 0x3F;
+uint8_t const DIR_ATT_FILE_TYPE_MASK = (DIR_ATT_VOLUME_ID | DIR_ATT_DIRECTORY);
+
+static inline uint8_t DIR_IS_LONG_NAME(const dir_t * dir) {
+	return (dir->attributes & DIR_ATT_LONG_NAME_MASK) == DIR_ATT_LONG_NAME;
+}
+
+static inline uint8_t DIR_IS_FILE(const dir_t * dir) {
+	return (dir->attributes & DIR_ATT_FILE_TYPE_MASK) == 0;
+}
+
+static inline uint8_t DIR_IS_SUBDIR(const dir_t * dir) {
+	return (dir->attributes & DIR_ATT_FILE_TYPE_MASK) == DIR_ATT_DIRECTORY;
+}
+
+static inline uint8_t DIR_IS_FILE_OR_SUBDIR(const dir_t * dir) {
+	return (dir->attributes & DIR_ATT_VOLUME_ID) == 0;
+}
+
+union cache_t {
+	uint8_t data[512];
+	uint16_t fat16[256];
+	uint32_t fat32[128];
+	dir_t dir[16];
+};
+
+class Sd2Card {
+public:
+	Sd2Card() : errorCode_(0), state_(IDLE) {}
+	
+	bool init(uint8_t sckRateID = SPI_FULL_SPEED, uint8_t chipSelectPin = 0);
+	uint32_t cardSize();
+	uint8_t errorCode() const { return errorCode_; }
+	
+	bool readBlock(uint32_t block, uint8_t * dst);
+	bool readStart(uint32_t block);
+	bool readData(uint8_t * dst);
+	bool readStop();
+	
+	bool writeBlock(uint32_t block, const uint8_t * src);
+	bool writeStart(uint32_t block, uint32_t eraseCount);
+	bool writeData(const uint8_t * src);
+	bool writeStop();
+	
+	void chipSelectHigh() {}
+	void chipSelectLow() {}
+	
+private:
+	enum { IDLE, READING, WRITING };
+	
+	uint8_t errorCode_;
+	uint8_t state_;
+	uint32_t block_;		// next block of the open transfer
+	uint32_t eraseEnd_;		// end of the blocks pre-erased by writeStart
+	
+	bool idle(uint8_t error);
+	bool fail(uint8_t error);
+};
+
+class SdVolume {
+public:
+	SdVolume() : fatType_(0) {}
+	
+	bool init(Sd2Card * dev);
+	cache_t * cacheClear();
+	
+	uint8_t blocksPerCluster() const { return blocksPerCluster_; }
+	uint32_t blocksPerFat() const { return blocksPerFat_; }
+	uint32_t clusterCount() const { return clusterCount_; }
+	uint8_t clusterSizeShift() const { return clusterSizeShift_; }
+	uint32_t dataStartBlock() const { return dataStartBlock_; }
+	uint8_t fatCount() const { return fatCount_; }
+	uint32_t fatStartBlock() const { return fatStartBlock_; }
+	uint8_t fatType() const { return fatType_; }
+	uint32_t rootDirEntryCount() const { return rootDirEntryCount_; }
+	uint32_t rootDirStart() const { return rootDirStart_; }
+	Sd2Card * sdCard() { return sdCard_; }
+	
+	bool dbgFat(uint32_t n, uint32_t * v) { return fatGet(n, v); }
+	
+private:
+	friend class SdBaseFile;
+	
+	static uint8_t const CACHE_FOR_READ = 0;
+	static uint8_t const CACHE_FOR_WRITE = 1;
+	static uint8_t const CACHE_RESERVE_FOR_WRITE = 2;	// the whole block is rewritten, don't read it
+	
+	static cache_t cacheBuffer_;
+	static uint32_t cacheBlockNumber_;
+	static Sd2Card * sdCard_;
+	static bool cacheDirty_;
+	static uint32_t cacheMirrorBlock_;	// second FAT copy of the cached block, 0 if none
+	
+	uint32_t allocSearchStart_;
+	uint8_t blocksPerCluster_;
+	uint32_t blocksPerFat_;
+	uint32_t clusterCount_;
+	uint8_t clusterSizeShift_;
+	uint32_t dataStartBlock_;
+	uint8_t fatCount_;
+	uint32_t fatStartBlock_;
+	uint8_t fatType_;
+	uint16_t rootDirEntryCount_;
+	uint32_t rootDirStart_;
+	
+	bool allocContiguous(uint32_t count, uint32_t * curCluster);
+	uint8_t blockOfCluster(uint32_t position) const {
+		return (position >> 9) & (blocksPerCluster_ - 1);
+	}
+	uint32_t clusterStartBlock(uint32_t cluster) const {
+		return dataStartBlock_ + ((cluster - 2) << clusterSizeShift_);
+	}
+	cache_t * cacheFetch(uint32_t block, uint8_t options);
+	bool cacheFlush();
+	bool chainSize(uint32_t cluster, uint32_t * size);
+	bool fatGet(uint32_t cluster, uint32_t * value);
+	bool fatPut(uint32_t cluster, uint32_t value);
+	bool fatPutEOC(uint32_t cluster) { return fatPut(cluster, 0x0FFFFFFF); }
+	bool freeChain(uint32_t cluster);
+	bool isEOC(uint32_t cluster) const {
+		return cluster >= (fatType_ == 16 ? 0xFFF8 : 0x0FFFFFF8);
+	}
+};
+
+class SdBaseFile {
+public:
+	SdBaseFile() : type_(FAT_FILE_TYPE_CLOSED) {}
+	
+	static SdBaseFile * cwd() { return cwd_; }
+	
+	bool openRoot(SdVolume * vol);
+	bool open(const char * path, uint8_t oflag = O_READ);
+	bool open(SdBaseFile * dirFile, const char * path, uint8_t oflag);
+	bool open(SdBaseFile * dirFile, uint16_t index, uint8_t oflag);
+	bool createContiguous(SdBaseFile * dirFile, const char * path, uint32_t size);
+	bool close();
+	bool sync();
+	bool remove();
+	bool truncate(uint32_t length);
+	
+	int read();
+	int read(void * buf, size_t nbyte);
+	int write(const void * buf, size_t nbyte);
+	int8_t readDir(dir_t * dir);
+	
+	bool seekSet(uint32_t pos);
+	bool seekCur(int32_t offset) { return seekSet(curPosition_ + offset); }
+	bool seekEnd(int32_t offset = 0) { return seekSet(fileSize_ + offset); }
+	void rewind() { seekSet(0); }
+	
+	bool contiguousRange(uint32_t * bgnBlock, uint32_t * endBlock);
+	bool dirEntry(dir_t * dir);
+	bool getFilename(char * name);
+	
+	uint32_t curCluster() const { return curCluster_; }
+	uint32_t curPosition() const { return curPosition_; }
+	uint32_t fileSize() const { return fileSize_; }
+	uint32_t firstCluster() const { return firstCluster_; }
+	bool isOpen() const { return type_ != FAT_FILE_TYPE_CLOSED; }
+	bool isDir() const { return type_ >= FAT_FILE_TYPE_MIN_DIR; }
+	bool isFile() const { return type_ == FAT_FILE_TYPE_NORMAL; }
+	bool isRoot() const { return type_ == FAT_FILE_TYPE_ROOT_FIXED || type_ == FAT_FILE_TYPE_ROOT32; }
+	bool isSubDir() const { return type_ == FAT_FILE_TYPE_SUBDIR; }
+	SdVolume * volume() const { return vol_; }
+	
+private:
+	friend class SdFat;
+	
+	static uint8_t const F_FILE_DIR_DIRTY = 0x80;
+	
+	static uint8_t const FAT_FILE_TYPE_CLOSED = 0;
+	static uint8_t const FAT_FILE_TYPE_NORMAL = 1;
+	static uint8_t const FAT_FILE_TYPE_ROOT_FIXED = 2;
+	static uint8_t const FAT_FILE_TYPE_ROOT32 = 3;
+	static uint8_t const FAT_FILE_TYPE_SUBDIR = 4;
+	static uint8_t const FAT_FILE_TYPE_MIN_DIR = FAT_FILE_TYPE_ROOT_FIXED;
+	
+	static SdBaseFile * cwd_;
+	
+	uint8_t flags_;
+	uint8_t type_;
+	uint32_t curCluster_;
+	uint32_t curPosition_;
+	uint32_t dirBlock_;
+	uint8_t dirIndex_;
+	uint32_t fileSize_;
+	uint32_t firstCluster_;
+	SdVolume * vol_;
+	
+	bool addCluster();
+	bool addDirCluster();
+	dir_t * cacheDirEntry(uint8_t action);
+	static bool make83Name(const char * str, uint8_t * name, const char ** ptr);
+	bool open(SdBaseFile * dirFile, const uint8_t dname[11], uint8_t oflag);
+	bool openCachedEntry(uint8_t dirIndex, uint8_t oflag);
+	bool openParent(SdBaseFile * dir);
+	dir_t * readDirCache();
+};
+
+class SdFile : public SdBaseFile {
+public:
+	SdFile() {}
+	SdFile(const char * path, uint8_t oflag) { open(path, oflag); }
+	
+	int write(const void * buf, size_t nbyte) { return SdBaseFile::write(buf, nbyte); }
+};
+
+class SdFat {
+public:
+	bool begin(uint8_t chipSelectPin = 0, uint8_t sckRateID = SPI_FULL_SPEED);
+	bool chdir(bool set_cwd = false);
+	bool chdir(const char * path, bool set_cwd = false);
+	bool exists(const char * name);
+	bool remove(const char * path);
+	
+	Sd2Card * card() { return &card_; }
+	SdVolume * vol() { return &vol_; }
+	SdBaseFile * vwd() { return &vwd_; }
+	
+private:
+	Sd2Card card_;
+	SdVolume vol_;
+	SdBaseFile vwd_;
+};
+
+#endif
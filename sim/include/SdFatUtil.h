@@ -0,0 +1,10 @@
+// sim stand-in
+#ifndef SIM_SDFATUTIL_H
+#define SIM_SDFATUTIL_H
+
+// there is no AVR heap or stack to measure here
+inline int FreeRam() {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,17 @@
+// sim stand-in: interrupt handlers become plain functions, the bench driver
+// calls INT0_vect itself when it raises Q
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector()
+#define SIGNAL(vector) void vector()
+
+void INT0_vect();
+void INT1_vect();
+
+inline void sei() {}
+inline void cli() {}
+
+#endif
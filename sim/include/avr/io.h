@@ -0,0 +1,8 @@
+// sim stand-in: nothing outside SDCardHAL.h touches a register, so the Linux
+// build needs no register definitions
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+#endif
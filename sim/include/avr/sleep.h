@@ -0,0 +1,15 @@
+// sim stand-in: sleeping is done by hal_sleep in sim/SDCardHAL.h
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#include <stdint.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_STANDBY 6
+
+inline void set_sleep_mode(uint8_t) {}
+inline void sleep_enable() {}
+inline void sleep_cpu() {}
+inline void sleep_disable() {}
+
+#endif
@@ -0,0 +1,12 @@
+// sim stand-in
+#ifndef SIM_AVR_WDT_H
+#define SIM_AVR_WDT_H
+
+#include <stdint.h>
+
+#define WDTO_15MS 0
+
+inline void wdt_disable() {}
+inline void wdt_enable(uint8_t) {}
+
+#endif
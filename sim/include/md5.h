@@ -0,0 +1,20 @@
+// sim stand-in for MD5_ASM, same interface (L. Peter Deutsch's md5.h)
+#ifndef SIM_MD5_H
+#define SIM_MD5_H
+
+#include <stdint.h>
+
+typedef uint8_t md5_byte_t;
+typedef uint32_t md5_word_t;
+
+typedef struct md5_state_s {
+	md5_word_t count[2];	// message length in bits, lsw first
+	md5_word_t abcd[4];
+	md5_byte_t buf[64];		// partial block
+} md5_state_t;
+
+void md5_init(md5_state_t * pms);
+void md5_append(md5_state_t * pms, const md5_byte_t * data, int nbytes);
+void md5_finish(md5_state_t * pms, md5_byte_t digest[16]);
+
+#endif
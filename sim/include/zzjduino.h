@@ -0,0 +1,39 @@
+// sim stand-in for the zzjduino core: time comes from the host's monotonic
+// clock, Serial goes to stderr
+#ifndef SIM_ZZJDUINO_H
+#define SIM_ZZJDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define bv(b) (1 << (b))
+#define bset(p, b) ((p) |= bv(b))
+#define bclr(p, b) ((p) &= ~bv(b))
+#define bisset(p, b) ((p) & bv(b))
+
+#define F(s) (s)
+
+void millis_start();
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+class SimSerial {
+public:
+	void begin(long) {}
+	void print(const char * s) { fputs(s, stderr); }
+	void print(long n) { fprintf(stderr, "%ld", n); }
+	void println(const char * s) { fprintf(stderr, "%s\n", s); }
+	void println(long n) { fprintf(stderr, "%ld\n", n); }
+	void write(uint8_t b) { fputc(b, stderr); }
+	int availableForWrite() { return 64; }
+};
+
+extern SimSerial Serial;
+
+#endif
@@ -0,0 +1,118 @@
+// MD5 (RFC 1321) for the Linux build, in place of MD5_ASM
+
+#include <string.h>
+
+#include <md5.h>
+
+static const md5_word_t K[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t R[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_process(md5_state_t * pms, const md5_byte_t * data) {
+	md5_word_t m[16];
+	md5_word_t a = pms->abcd[0], b = pms->abcd[1], c = pms->abcd[2], d = pms->abcd[3];
+	
+	for (int i = 0; i < 16; i++)
+		m[i] = data[i * 4] | (data[i * 4 + 1] << 8) | (data[i * 4 + 2] << 16) | ((md5_word_t)data[i * 4 + 3] << 24);
+	
+	for (int i = 0; i < 64; i++) {
+		md5_word_t f;
+		int g;
+		
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		
+		md5_word_t t = d;
+		
+		d = c;
+		c = b;
+		f += a + K[i] + m[g];
+		b += (f << R[i]) | (f >> (32 - R[i]));
+		a = t;
+	}
+	
+	pms->abcd[0] += a;
+	pms->abcd[1] += b;
+	pms->abcd[2] += c;
+	pms->abcd[3] += d;
+}
+
+void md5_init(md5_state_t * pms) {
+	pms->count[0] = pms->count[1] = 0;
+	pms->abcd[0] = 0x67452301;
+	pms->abcd[1] = 0xefcdab89;
+	pms->abcd[2] = 0x98badcfe;
+	pms->abcd[3] = 0x10325476;
+}
+
+void md5_append(md5_state_t * pms, const md5_byte_t * data, int nbytes) {
+	if (nbytes <= 0)
+		return;
+	
+	int used = (pms->count[0] >> 3) & 63;
+	md5_word_t bits = (md5_word_t)nbytes << 3;
+	
+	pms->count[1] += nbytes >> 29;
+	pms->count[0] += bits;
+	
+	if (pms->count[0] < bits)
+		pms->count[1]++;
+	
+	if (used) {
+		int copy = (used + nbytes > 64) ? 64 - used : nbytes;
+		
+		memcpy(pms->buf + used, data, copy);
+		
+		if (used + copy < 64)
+			return;
+		
+		md5_process(pms, pms->buf);
+		data += copy;
+		nbytes -= copy;
+	}
+	
+	for (; nbytes >= 64; data += 64, nbytes -= 64)
+		md5_process(pms, data);
+	
+	if (nbytes)
+		memcpy(pms->buf, data, nbytes);
+}
+
+void md5_finish(md5_state_t * pms, md5_byte_t digest[16]) {
+	static const md5_byte_t pad[64] = { 0x80 };
+	md5_byte_t length[8];
+	
+	for (int i = 0; i < 8; i++)
+		length[i] = pms->count[i >> 2] >> ((i & 3) << 3);
+	
+	md5_append(pms, pad, ((55 - (pms->count[0] >> 3)) & 63) + 1);
+	md5_append(pms, length, 8);
+	
+	for (int i = 0; i < 16; i++)
+		digest[i] = pms->abcd[i >> 2] >> ((i & 3) << 3);
+}